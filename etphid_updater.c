@@ -4,6 +4,7 @@
  * found in the LICENSE file.
  */
 
+#include <ctype.h>
 #include <errno.h>
 #include <getopt.h>
 #include <poll.h>
@@ -17,13 +18,21 @@
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <fcntl.h>
+#include <time.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <linux/i2c-dev.h>
 #include <stdint.h>
 #include <dirent.h>
+#include <limits.h>
 #include <linux/types.h>
 #include <linux/input.h>
 #include <linux/hidraw.h>
@@ -53,7 +62,9 @@ static char *firmware_binary = "elan_i2c.bin";	/* firmware blob */
 #define MAX_FW_SIZE			(MAX_FW_PAGE_COUNT*FW_PAGE_SIZE)
 #define FW_SIGNATURE_SIZE	6
 
-static uint8_t fw_data[MAX_FW_SIZE];
+static uint8_t *fw_data;		/* see elan_map_image() */
+static int fw_image_size;
+static uint64_t fw_image_hash;		/* only set when a journal or plan file needs it */
 int fw_page_count;
 int fw_size;
 int fw_size_all = 0;
@@ -76,12 +87,69 @@ static int eeprom_driver_ic=-1;
 static int eeprom_iap_version = -1;
 
 static int skip_rule=1; 
+static int poll_mode = 0;
+static int burst_mode = 0;
+static int eeprom_timeout_ms = 10 * 1000;
+static int eeprom_burst = 0;
+static int eeprom_payload = 0;		/* 0: 32 byte writes in full size frames */
+static int skip_identical = 0;
+static int count_blank = 0;
+static int bench_jobs = 1;
+static int only_newer = -1;
+static char *manifest_dir = NULL;
+static char *journal_path = NULL;
+static char *plan_path = NULL;
+static char *cache_path = NULL;
+static int identity_cached = 0;		/* ic_type, module_id, ... came from the cache */
+static int device_iap_checksum = -1;
+#define MANIFEST_DEFAULT_DIR		"/var/lib/etphid_updater"
+#define JOURNAL_DEFAULT_PATH		MANIFEST_DEFAULT_DIR "/journal"
+#define CACHE_DEFAULT_PATH		"/run/etphid_updater.cache"
 /* Utility functions */
 static int le_bytes_to_int(uint8_t *buf)
 {
 	return buf[0] + (int)(buf[1] << 8);
 }
 
+static void le_int_to_bytes(uint8_t *buf, int val)
+{
+	buf[0] = val & 0xFF;
+	buf[1] = (val >> 8) & 0xFF;
+}
+
+static uint64_t elan_get_time_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Long-only options */
+#define OPT_POLL			0x100
+#define OPT_SIM				0x101
+#define OPT_SIM_DUMP			0x102
+#define OPT_SKIP_IDENTICAL		0x103
+#define OPT_ONLY_NEWER			0x104
+#define OPT_DELTA			0x105
+#define OPT_JOURNAL			0x106
+#define OPT_INSPECT			0x107
+#define OPT_FLASH_PLAN			0x108
+#define OPT_JSON			0x109
+#define OPT_CACHE			0x10A
+#define OPT_DAEMON			0x10B
+#define OPT_STATS			0x10C
+#define OPT_TRACE			0x10D
+#define OPT_REPLAY			0x10E
+#define OPT_BENCH			0x10F
+#define OPT_BURST			0x110
+#define OPT_EEPROM_TIMEOUT		0x111
+#define OPT_EEPROM_BURST		0x112
+#define OPT_COUNT_BLANK			0x113
+#define OPT_PACK_BUNDLE			0x114
+#define OPT_SELFTEST			0x115
+#define OPT_BENCH_JOBS			0x116
+
 /* Command line parsing related */
 static char *progname;
 static char *short_opts = ":b:E:v:p:i:h:gdmzwa:CGcIs:R:r";
@@ -106,6 +174,29 @@ static const struct option long_opts[] = {
 	{"help",     0,   NULL, '?'},
 	{"version",    0,   NULL, 'z'},
 	{"debug",    0,   NULL, 'd'},
+	{"poll",     0,   NULL, OPT_POLL},
+	{"sim",      2,   NULL, OPT_SIM},
+	{"sim-dump", 1,   NULL, OPT_SIM_DUMP},
+	{"skip-identical", 0, NULL, OPT_SKIP_IDENTICAL},
+	{"only-newer", 1,  NULL, OPT_ONLY_NEWER},
+	{"delta",    2,   NULL, OPT_DELTA},
+	{"journal",  2,   NULL, OPT_JOURNAL},
+	{"inspect",  1,   NULL, OPT_INSPECT},
+	{"flash-plan", 1, NULL, OPT_FLASH_PLAN},
+	{"json",     0,   NULL, OPT_JSON},
+	{"cache",    2,   NULL, OPT_CACHE},
+	{"daemon",   1,   NULL, OPT_DAEMON},
+	{"stats",    0,   NULL, OPT_STATS},
+	{"trace",    1,   NULL, OPT_TRACE},
+	{"replay",   1,   NULL, OPT_REPLAY},
+	{"bench",    0,   NULL, OPT_BENCH},
+	{"burst",    0,   NULL, OPT_BURST},
+	{"eeprom-timeout", 1, NULL, OPT_EEPROM_TIMEOUT},
+	{"eeprom-burst", 0, NULL, OPT_EEPROM_BURST},
+	{"count-blank", 0, NULL, OPT_COUNT_BLANK},
+	{"pack-bundle", 1, NULL, OPT_PACK_BUNDLE},
+	{"selftest", 0,   NULL, OPT_SELFTEST},
+	{"bench-jobs", 1, NULL, OPT_BENCH_JOBS},
 	{NULL,       0,   NULL, 0},
 };
 
@@ -134,6 +225,61 @@ static void usage(int errs)
 	       "  -R,--set_region_layout  	Set Keyboard Region layout\n"
 	       "  -r,--get_region_layout  	Get Keyboard Region layout\n"
 	       "  -d,--debug              	Exercise extended read I2C over HID\n"	
+	       "     --poll               	Poll mode changes instead of fixed delays; IAP\n"
+	       "                          	pages keep their delay and are polled after it\n"
+	       "     --burst              	Send whole 512 byte pages in one report when the\n"
+	       "                          	part accepts it (IC 0x14/0x15, IAP version 3+)\n"
+	       "     --eeprom-timeout INT 	Milliseconds to wait for the EEPROM checksum\n"
+	       "                          	computation (default 10000)\n"
+	       "     --eeprom-burst       	Write the EEPROM in right-sized frames with the\n"
+	       "                          	largest payload the part takes (128/64/32)\n"
+	       "     --count-blank        	Count the pages that are all 0xFF; they are\n"
+	       "                          	still written\n"
+	       "     --sim[=SPEC]         	Run against the built-in device model, SPEC is\n"
+	       "                          	ic=,iap=,module=,fw=,section=,latency=(us),\n"
+	       "                          	reset=(us),eeprom=(0|1),rev=,stuck=(pages),\n"
+	       "                          	force=(flimforce table address),\n"
+	       "                          	calc=(EEPROM checksum us),io=(us per report),\n"
+	       "                          	payload=(largest EEPROM write)\n"
+	       "     --sim-dump STR       	Write a firmware image matching the model\n"
+	       "     --skip-identical     	Skip the update if the device runs this image\n"
+	       "     --only-newer HEXVAL  	Skip the update unless the device version (as\n"
+	       "                          	printed by -g/-G) is older than HEXVAL\n"
+	       "     --delta[=DIR]        	Write only the pages that changed since the\n"
+	       "                          	last update (manifest in DIR, default\n"
+	       "                          	" MANIFEST_DEFAULT_DIR ")\n"
+	       "     --journal[=STR]      	Keep a progress journal so an interrupted update\n"
+	       "                          	can resume (default " JOURNAL_DEFAULT_PATH ";\n"
+	       "                          	one sync per confirmed page)\n"
+	       "     --inspect STR        	Print image details as JSON without a device;\n"
+	       "                          	a directory is searched for *.bin files\n"
+	       "     --pack-bundle STR DIR	Pack the images under DIR into the bundle STR;\n"
+	       "                          	-b takes a bundle and picks the image for the\n"
+	       "                          	part by module ID, IAP version and IC type\n"
+	       "                          	(\"_icXX\" in the file name, any without)\n"
+	       "     --json               	Print the queries given (-g -m -w -c -I -C -G\n"
+	       "                          	-r, all of them when none is given) as one\n"
+	       "                          	JSON object; implied by more than one query\n"
+	       "     --flash-plan STR     	Keep the prebuilt update frames in STR and\n"
+	       "                          	reuse them for the same image and model\n"
+	       "     --cache[=STR]        	Remember the device node and identity until\n"
+	       "                          	reboot, update or reset (default\n"
+	       "                          	" CACHE_DEFAULT_PATH ")\n"
+	       "     --daemon STR         	Keep the device open and serve queries and\n"
+	       "                          	updates on the Unix socket STR\n"
+	       "     --stats              	Print latency histograms per register,\n"
+	       "                          	transport operation and update phase, and\n"
+	       "                          	sleep time per call site on exit\n"
+	       "     --trace STR          	Record every device transaction to STR\n"
+	       "                          	(with --bench, each update to STR.<ic>-<image>)\n"
+	       "     --replay STR         	Use a recorded trace in place of the device\n"
+	       "     --bench              	Time main and EEPROM updates of every IC type\n"
+	       "                          	against the simulator (latencies from --sim),\n"
+	       "                          	one JSON line per update\n"
+	       "     --bench-jobs INT     	Updates run at the same time by --bench\n"
+	       "                          	(default 1, so timings do not depend on load)\n"
+	       "     --selftest           	Check the vector checksum kernels against the\n"
+	       "                          	scalar ones and exit\n"
 	       "  -z,--version              	Version\n"	
 	       "  -?,--help               	Show this message\n"
 	       "\n", progname, firmware_binary, vid, pid, i2caddr);
@@ -153,11 +299,40 @@ static void usage(int errs)
 #define GET_IAP_CHECKSUM_STATE		10
 #define SET_REGION_LAYOUT_STATE		11
 #define GET_REGION_LAYOUT_STATE		12
+#define SIM_DUMP_STATE			13
+#define INSPECT_STATE			14
+#define QUERY_STATE			15
+#define DAEMON_STATE			16
+#define BENCH_STATE			17
+#define PACK_BUNDLE_STATE		18
+#define SELFTEST_STATE			19
+static int sim_enabled;
+static int sim_parse_spec(char *spec);
+static char *inspect_path;
+static char *pack_bundle_path;
+static char *pack_bundle_dir;
+static int query_mask;
+static int json_output;
+static char *daemon_path;
+static int stats_enabled;
+static void elan_print_stats(void);
+static char *trace_path;
+static char *replay_path;
+#define QUERY_FWVER			(1 << 0)
+#define QUERY_MODULEID			(1 << 1)
+#define QUERY_HWID			(1 << 2)
+#define QUERY_FW_CHECKSUM		(1 << 3)
+#define QUERY_IAP_CHECKSUM		(1 << 4)
+#define QUERY_EEPROM_CHECKSUM		(1 << 5)
+#define QUERY_EEPROM_VERSION		(1 << 6)
+#define QUERY_REGION			(1 << 7)
+#define QUERY_ALL			0xFF
 static int parse_cmdline(int argc, char *argv[])
 {
 	char *e = 0;
 	int i, errorcnt = 0;
 	int state = IAP_STATE;
+	int update_requested = 0;
 	progname = strrchr(argv[0], '/');
 	if (progname)
 		progname++;
@@ -169,10 +344,12 @@ static int parse_cmdline(int argc, char *argv[])
 		switch (i) {
 		case 'b':
 			firmware_binary = optarg;
+			update_requested = 1;
 			break;
 		case 'E':
 			firmware_binary = optarg;
 			state = EEPROM_IAP_STATE;
+			update_requested = 1;
 			break;
 		case 'p':
 			pid = (uint16_t) strtoul(optarg, &e, 16);
@@ -218,24 +395,31 @@ static int parse_cmdline(int argc, char *argv[])
 			break;
 		case 'g':
 			state = GET_FWVER_STATE;
+			query_mask |= QUERY_FWVER;
 			break;	
 		case 'm':
 			state = GET_MODULEID_STATE;
+			query_mask |= QUERY_MODULEID;
 			break;
 		case 'w':
 			state = GET_HWID_STATE;
+			query_mask |= QUERY_HWID;
 			break;	
 		case 'c':
 			state = GET_FW_CHECKSUM_STATE;
+			query_mask |= QUERY_FW_CHECKSUM;
 			break;	
 		case 'I':
 			state = GET_IAP_CHECKSUM_STATE;
+			query_mask |= QUERY_IAP_CHECKSUM;
 			break;	
 		case 'C':
 			state = GET_EEPROM_CHECKSUM_STATE;
+			query_mask |= QUERY_EEPROM_CHECKSUM;
 			break;	
 		case 'G':
 			state = GET_EEPROM_VERSION_STATE;
+			query_mask |= QUERY_EEPROM_VERSION;
 			break;
 		case 'R':
 			region_code  = (int) strtoul(optarg, &e, 10);
@@ -247,10 +431,102 @@ static int parse_cmdline(int argc, char *argv[])
 			break;
 		case 'r':
 			state = GET_REGION_LAYOUT_STATE;
+			query_mask |= QUERY_REGION;
 			break;
 		case 'd':
 			extended_i2c_exercise = 1;
 			break;
+		case OPT_POLL:
+			poll_mode = 1;
+			break;
+		case OPT_BURST:
+			burst_mode = 1;
+			break;
+		case OPT_PACK_BUNDLE:
+			pack_bundle_path = optarg;
+			state = PACK_BUNDLE_STATE;
+			break;
+		case OPT_COUNT_BLANK:
+			count_blank = 1;
+			break;
+		case OPT_SELFTEST:
+			state = SELFTEST_STATE;
+			break;
+		case OPT_EEPROM_BURST:
+			eeprom_burst = 1;
+			break;
+		case OPT_BENCH_JOBS:
+			bench_jobs = (int) strtoul(optarg, &e, 10);
+			if (!*optarg || (e && *e) || (bench_jobs <= 0)) {
+				printf("Invalid argument: \"%s\"\n", optarg);
+				errorcnt++;
+			}
+			break;
+		case OPT_EEPROM_TIMEOUT:
+			eeprom_timeout_ms = (int) strtoul(optarg, &e, 10);
+			if (!*optarg || (e && *e) || (eeprom_timeout_ms <= 0)) {
+				printf("Invalid argument: \"%s\"\n", optarg);
+				errorcnt++;
+			}
+			break;
+		case OPT_SIM:
+			sim_enabled = 1;
+			if (optarg && sim_parse_spec(optarg))
+				errorcnt++;
+			break;
+		case OPT_SKIP_IDENTICAL:
+			skip_identical = 1;
+			break;
+		case OPT_ONLY_NEWER:
+			only_newer = (int) strtoul(optarg, &e, 16);
+			if (!*optarg || (e && *e)) {
+				printf("Invalid argument: \"%s\"\n", optarg);
+				errorcnt++;
+			}
+			break;
+		case OPT_DELTA:
+			manifest_dir = optarg ? optarg : MANIFEST_DEFAULT_DIR;
+			break;
+		case OPT_JOURNAL:
+			journal_path = optarg ? optarg : JOURNAL_DEFAULT_PATH;
+			break;
+		case OPT_JSON:
+			json_output = 1;
+			break;
+		case OPT_FLASH_PLAN:
+			plan_path = optarg;
+			break;
+		case OPT_CACHE:
+			cache_path = optarg ? optarg : CACHE_DEFAULT_PATH;
+			break;
+		case OPT_DAEMON:
+			daemon_path = optarg;
+			state = DAEMON_STATE;
+			break;
+		case OPT_BENCH:
+			sim_enabled = 1;
+			state = BENCH_STATE;
+			break;
+		case OPT_TRACE:
+			trace_path = optarg;
+			break;
+		case OPT_REPLAY:
+			replay_path = optarg;
+			break;
+		case OPT_STATS:
+			if (!stats_enabled)
+				atexit(elan_print_stats);
+			stats_enabled = 1;
+			break;
+		case OPT_INSPECT:
+			inspect_path = optarg;
+			state = INSPECT_STATE;
+			break;
+		case OPT_SIM_DUMP:
+			sim_enabled = 1;
+			firmware_binary = optarg;
+			state = SIM_DUMP_STATE;
+			break;
 		/*case '?':
 			usage(errorcnt);
 			break;*/
@@ -277,16 +553,84 @@ static int parse_cmdline(int argc, char *argv[])
 		}
 	}
 
+	if (state == PACK_BUNDLE_STATE) {
+		if (optind == argc - 1)
+			pack_bundle_dir = argv[optind];
+		else {
+			printf("--pack-bundle takes one image directory\n");
+			errorcnt++;
+		}
+	}
+	if (replay_path && sim_enabled) {
+		printf("--replay and --sim both stand in for the device\n");
+		errorcnt++;
+	}
 	if (errorcnt)
 		usage(errorcnt);
+	if (json_output && !query_mask && !update_requested && (state == IAP_STATE))
+		query_mask = QUERY_ALL;
+	if (query_mask && (json_output || (query_mask & (query_mask - 1))))
+		state = QUERY_STATE;
 	return state;
 
 }
 
 /* HID transfer related */
-static uint8_t rx_buf[1024];
+#define ETP_EEPROM_PAGE_SIZE		32
+#define ETP_MAX_PAGE_SIZE		512
+#define ETP_HID_REPORT_HDR		3
+#define MAX_REC_SIZE 950
+
+/*
+ * rx_buf sits right after a HID report header so register reads land in
+ * it straight from HIDIOCGFEATURE without a bounce buffer.
+ */
+static uint8_t rx_report[ETP_HID_REPORT_HDR + 1024];
+static uint8_t *const rx_buf = rx_report + ETP_HID_REPORT_HDR;
 static uint8_t tx_buf[1024];
 
+/*
+ * Session buffers for everything else on the command path, sized for the
+ * largest frame the protocol builds (an I2C EEPROM frame for a 512 byte
+ * page), so no report, frame or block read is allocated per call.
+ */
+#define ETP_FRAME_BUF_SIZE		(ETP_MAX_PAGE_SIZE * 2 + 16)
+static struct {
+	uint8_t report[ETP_FRAME_BUF_SIZE];
+	uint8_t block[MAX_REC_SIZE + 8];
+} session;
+
+#ifdef ETP_COUNT_ALLOCS
+/*
+ * Allocation counter for the "make check" build, which links with
+ * -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc.  Only calls made by
+ * the updater itself are routed here, allocations inside libc are not.
+ */
+static unsigned long heap_allocations;
+
+extern void *__real_malloc(size_t size);
+extern void *__real_calloc(size_t nmemb, size_t size);
+extern void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+	heap_allocations++;
+	return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+	heap_allocations++;
+	return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+	heap_allocations++;
+	return __real_realloc(ptr, size);
+}
+#endif
+
 static int do_exit;
 
 static void request_exit(const char *format, ...)
@@ -311,9 +655,459 @@ static void request_exit(const char *format, ...)
 static int dev_fd;
 static int bus_type = -1;
 static int interface_type = -1;
+
+/*
+ * Transport backends.  One is chosen when the interface is known and all
+ * protocol code goes through it, so new backends do not touch the
+ * register and IAP logic.  Backends that speak HID feature reports share
+ * the HID framing and only provide set_feature/get_feature.
+ */
+struct elan_transport {
+	const char *name;
+	int (*write_cmd)(unsigned char *tx, unsigned char *rx);
+	int (*read_cmd)(unsigned char *tx, unsigned char *rx, int rx_length);
+	/* Frame builders return the frame length, send_frame puts one on the wire */
+	int (*fw_frame)(uint8_t *frame, const uint8_t *raw_data, uint16_t checksum);
+	int (*eeprom_frame)(uint8_t *frame, int index, const uint8_t *raw_data,
+			    unsigned short checksum, int eeprom_page_size);
+	int (*send_frame)(uint8_t *frame, int len);
+	int (*set_feature)(uint8_t *buf, int len);
+	int (*get_feature)(uint8_t *buf, int len);
+	/* Per-backend cost */
+	unsigned long transactions;
+	uint64_t busy_us;
+};
+static struct elan_transport *transport;
+static void elan_set_interface(int type);
 static char raw_name[255];
 static int is_new_pattern=0;
 static int elan_read_cmd(int reg);
+
+/*
+ * Transaction trace.  Every report and every I2C read or write goes
+ * through elan_wire(), which with --trace appends a record (operation,
+ * bytes on the wire, result, start time and duration) to a 1 MiB buffer
+ * that is only written out when full and at exit.  --replay feeds a trace
+ * back in place of the device: reads return the recorded bytes after the
+ * recorded device time, writes are compared with what the host sent then.
+ */
+#define TRACE_MAGIC			"ETPTRCE1"
+#define TRACE_BUF_SIZE			(1 << 20)
+
+enum {
+	TRACE_SET_FEATURE = 1,
+	TRACE_GET_FEATURE,
+	TRACE_WRITE,
+	TRACE_READ,
+	TRACE_OPEN,			/* device found, result is the interface */
+};
+
+struct elan_trace_header {
+	char magic[8];
+	uint64_t start_time;		/* seconds since the epoch */
+};
+
+struct elan_trace_record {
+	uint8_t op;
+	uint8_t reserved;
+	uint16_t len;			/* payload bytes that follow */
+	int32_t result;
+	uint32_t time_us;		/* since the trace was opened */
+	uint32_t duration_us;
+};
+
+static int trace_fd = -1;
+static uint64_t trace_start_us;
+static uint8_t trace_buf[TRACE_BUF_SIZE];
+static int trace_used;
+
+static const uint8_t *replay_data;	/* mapped trace, see elan_replay_open() */
+static size_t replay_size, replay_pos;
+static unsigned long replay_count, replay_mismatches;
+static int replay_diverged;
+
+static void elan_trace_flush(void)
+{
+	if ((trace_fd >= 0) && trace_used &&
+	    (write(trace_fd, trace_buf, trace_used) != trace_used))
+		printf("Trace: write failed (%s)\n", strerror(errno));
+	trace_used = 0;
+}
+
+static void elan_trace(int op, const uint8_t *buf, int len, int result, uint64_t start)
+{
+	struct elan_trace_record r;
+	uint64_t now = elan_get_time_us();
+
+	if (len < 0)
+		len = 0;
+	if (trace_used + (int)sizeof(r) + len > TRACE_BUF_SIZE)
+		elan_trace_flush();
+	if ((int)sizeof(r) + len > TRACE_BUF_SIZE)
+		return;
+	memset(&r, 0, sizeof(r));
+	r.op = op;
+	r.len = len;
+	r.result = result;
+	r.time_us = start - trace_start_us;
+	r.duration_us = now - start;
+	memcpy(trace_buf + trace_used, &r, sizeof(r));
+	if (len)
+		memcpy(trace_buf + trace_used + sizeof(r), buf, len);
+	trace_used += sizeof(r) + len;
+}
+
+static void elan_trace_close(void)
+{
+	elan_trace_flush();
+	if (trace_fd >= 0)
+		close(trace_fd);
+	trace_fd = -1;
+}
+
+static void elan_trace_open(const char *path)
+{
+	struct elan_trace_header h;
+
+	trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+	if (trace_fd < 0)
+		request_exit("Cannot create trace %s (%s)\n", path, strerror(errno));
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, TRACE_MAGIC, sizeof(h.magic));
+	h.start_time = time(NULL);
+	memcpy(trace_buf, &h, sizeof(h));
+	trace_used = sizeof(h);
+	trace_start_us = elan_get_time_us();
+	atexit(elan_trace_close);
+}
+
+static void elan_replay_summary(void)
+{
+	printf("Replay: %lu transactions, %lu writes differ from the trace, %s\n",
+		replay_count, replay_mismatches,
+		replay_diverged ? "diverged" :
+		(replay_pos == replay_size) ? "trace complete" : "trace not used up");
+}
+
+static void elan_replay_open(const char *path)
+{
+	struct elan_trace_header *h;
+	struct stat st;
+	int fd = open(path, O_RDONLY);
+
+	if ((fd < 0) || (fstat(fd, &st) < 0))
+		request_exit("Cannot open trace %s\n", path);
+	replay_size = st.st_size;
+	replay_data = (replay_size >= sizeof(*h)) ?
+		mmap(NULL, replay_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+	close(fd);
+	h = (struct elan_trace_header *)replay_data;
+	if ((replay_data == MAP_FAILED) || memcmp(h->magic, TRACE_MAGIC, sizeof(h->magic)))
+		request_exit("%s is not a trace\n", path);
+	replay_pos = sizeof(*h);
+	atexit(elan_replay_summary);
+}
+
+/* Next record of the given kind, or NULL at the end of the trace */
+static const struct elan_trace_record *elan_replay_next(int open)
+{
+	const struct elan_trace_record *r;
+
+	while (replay_pos + sizeof(*r) <= replay_size) {
+		r = (const struct elan_trace_record *)(replay_data + replay_pos);
+		if (replay_pos + sizeof(*r) + r->len > replay_size)
+			break;
+		replay_pos += sizeof(*r) + r->len;
+		/* Discovery traffic before the device was opened is not replayed */
+		if ((r->op == TRACE_OPEN) == open)
+			return r;
+	}
+	replay_pos = replay_size;
+	return NULL;
+}
+
+/* The interface the traced session ended up with */
+static int elan_replay_interface(void)
+{
+	const struct elan_trace_record *r = elan_replay_next(1);
+
+	if (!r)
+		request_exit("The trace never opened a device\n");
+	return r->result;
+}
+
+static int elan_replay(int op, uint8_t *buf, int len)
+{
+	static const char *const names[] = { "", "set", "get", "write", "read" };
+	const struct elan_trace_record *r;
+
+	if (replay_diverged)
+		return -1;
+	r = elan_replay_next(0);
+	if (!r || (r->op != op) || (((op == TRACE_GET_FEATURE) || (op == TRACE_READ)) &&
+				    (r->len != len))) {
+		printf("Replay: diverged at transaction %lu, host did %s of %d bytes, "
+		       "trace has %s\n", replay_count, names[op], len,
+		       r ? names[r->op] : "ended");
+		replay_diverged = 1;
+		return -1;
+	}
+	replay_count++;
+	if ((op == TRACE_GET_FEATURE) || (op == TRACE_READ))
+		memcpy(buf, r + 1, len);
+	else if ((r->len != len) || memcmp(buf, r + 1, len))
+		replay_mismatches++;
+	if (r->duration_us)
+		usleep(r->duration_us);
+	return r->result;
+}
+
+/* Every byte to or from the device passes here */
+static int elan_wire(int op, uint8_t *buf, int len)
+{
+	uint64_t start = 0;
+	int res;
+
+	if (replay_data)
+		return elan_replay(op, buf, len);
+	if (trace_fd >= 0)
+		start = elan_get_time_us();
+	switch (op) {
+	case TRACE_SET_FEATURE:
+		res = transport->set_feature(buf, len);
+		break;
+	case TRACE_GET_FEATURE:
+		res = transport->get_feature(buf, len);
+		break;
+	case TRACE_WRITE:
+		res = write(dev_fd, buf, len);
+		break;
+	default:
+		res = read(dev_fd, buf, len);
+		break;
+	}
+	if (trace_fd >= 0)
+		elan_trace(op, buf, len, res, start);
+	return res;
+}
+
+/*
+ * --stats.  Transport latencies go into log-linear histograms (four
+ * buckets per power of two microseconds) per register, per transport
+ * operation and per update phase.  Sleeps are summed per call site, so a
+ * retry loop shows up as the call count of its sleep.  With stats off
+ * every hook is a single test.
+ */
+#define STATS_SUB_BITS			2
+#define STATS_BUCKETS			112
+#define STATS_MAX_REGS			64
+#define STATS_MAX_SITES			96
+
+struct stats_hist {
+	uint32_t count;
+	uint64_t total_us;
+	uint64_t max_us;
+	uint32_t bucket[STATS_BUCKETS];
+};
+
+enum { STATS_OP_READ, STATS_OP_WRITE, STATS_OP_FRAME, STATS_OPS };
+static const char *const stats_op_name[STATS_OPS] = {
+	"read_cmd", "write_cmd", "send_frame",
+};
+
+enum {
+	PHASE_DISCOVER, PHASE_LOAD, PHASE_PREPARE, PHASE_FLASH, PHASE_VERIFY,
+	PHASE_RESET, PHASES
+};
+static const char *const stats_phase_name[PHASES] = {
+	"discover", "load", "prepare", "flash", "verify", "reset",
+};
+
+static struct stats_hist stats_op[STATS_OPS];
+static struct {
+	int reg;
+	int op;
+	struct stats_hist hist;
+} stats_reg[STATS_MAX_REGS];
+static int stats_reg_count;
+static struct {
+	const char *func;
+	int line;
+	uint32_t count;
+	uint64_t total_us;
+} stats_site[STATS_MAX_SITES];
+static int stats_site_count;
+static struct {
+	uint64_t wall_us;
+	uint64_t sleep_us;
+	struct stats_hist hist;
+} stats_phase[PHASES];
+static int stats_cur_phase = -1;
+static uint64_t stats_phase_start;
+
+static int stats_bucket(uint64_t us)
+{
+	int msb, b;
+
+	if (us < (1 << STATS_SUB_BITS))
+		return us;
+	msb = 63 - __builtin_clzll(us);
+	b = ((msb - STATS_SUB_BITS + 1) << STATS_SUB_BITS) +
+	    ((us >> (msb - STATS_SUB_BITS)) & ((1 << STATS_SUB_BITS) - 1));
+	return (b < STATS_BUCKETS) ? b : STATS_BUCKETS - 1;
+}
+
+/* Smallest value that falls into bucket b */
+static uint64_t stats_bucket_floor(int b)
+{
+	int sub = b & ((1 << STATS_SUB_BITS) - 1);
+	int msb = (b >> STATS_SUB_BITS) + STATS_SUB_BITS - 1;
+
+	if (b < (1 << STATS_SUB_BITS))
+		return b;
+	return (uint64_t)((1 << STATS_SUB_BITS) + sub) << (msb - STATS_SUB_BITS);
+}
+
+static void stats_record(struct stats_hist *h, uint64_t us)
+{
+	h->count++;
+	h->total_us += us;
+	if (us > h->max_us)
+		h->max_us = us;
+	h->bucket[stats_bucket(us)]++;
+}
+
+/* Upper edge of the bucket holding the pct'th percentile, capped at max */
+static uint64_t stats_percentile(const struct stats_hist *h, int pct)
+{
+	uint64_t want = ((uint64_t)h->count * pct + 99) / 100, seen = 0;
+
+	for (int b = 0; b < STATS_BUCKETS - 1; b++) {
+		seen += h->bucket[b];
+		if (seen >= want) {
+			uint64_t edge = stats_bucket_floor(b + 1) - 1;
+			return (edge < h->max_us) ? edge : h->max_us;
+		}
+	}
+	return h->max_us;
+}
+
+static void elan_stats_command(int op, int reg, uint64_t us)
+{
+	int i;
+
+	stats_record(&stats_op[op], us);
+	if (stats_cur_phase >= 0)
+		stats_record(&stats_phase[stats_cur_phase].hist, us);
+	for (i = 0; i < stats_reg_count; i++)
+		if ((stats_reg[i].reg == reg) && (stats_reg[i].op == op))
+			break;
+	if (i == stats_reg_count) {
+		if (i == STATS_MAX_REGS)
+			return;
+		stats_reg[i].reg = reg;
+		stats_reg[i].op = op;
+		stats_reg_count++;
+	}
+	stats_record(&stats_reg[i].hist, us);
+}
+
+static void elan_stats_phase(int phase)
+{
+	uint64_t now;
+
+	if (!stats_enabled)
+		return;
+	now = elan_get_time_us();
+	if (stats_cur_phase >= 0)
+		stats_phase[stats_cur_phase].wall_us += now - stats_phase_start;
+	stats_cur_phase = phase;
+	stats_phase_start = now;
+}
+
+#define SLEEP(us)	elan_sleep(us, __func__, __LINE__)
+
+static void elan_sleep(int us, const char *func, int line)
+{
+	uint64_t start;
+	int i;
+
+	if (!stats_enabled) {
+		usleep(us);
+		return;
+	}
+	start = elan_get_time_us();
+	usleep(us);
+	start = elan_get_time_us() - start;
+
+	if (stats_cur_phase >= 0)
+		stats_phase[stats_cur_phase].sleep_us += start;
+	for (i = 0; i < stats_site_count; i++)
+		if (stats_site[i].line == line)
+			break;
+	if (i == stats_site_count) {
+		if (i == STATS_MAX_SITES)
+			return;
+		stats_site[i].func = func;
+		stats_site[i].line = line;
+		stats_site_count++;
+	}
+	stats_site[i].count++;
+	stats_site[i].total_us += start;
+}
+
+static void stats_print_hist(const char *name, const struct stats_hist *h)
+{
+	printf("  %-22s %7u %10.1f %8llu %8llu %8llu\n", name, h->count,
+		h->total_us / 1000.0,
+		(unsigned long long)stats_percentile(h, 50),
+		(unsigned long long)stats_percentile(h, 99),
+		(unsigned long long)h->max_us);
+}
+
+static void elan_print_stats(void)
+{
+	char name[32];
+
+	elan_stats_phase(-1);
+	fflush(stdout);
+	printf("\nStats: phases          wall ms   sleep ms   cmds   p50 us   p99 us   max us\n");
+	for (int i = 0; i < PHASES; i++) {
+		const struct stats_hist *h = &stats_phase[i].hist;
+
+		if (!stats_phase[i].wall_us)
+			continue;
+		printf("  %-18s %10.1f %10.1f %6u %8llu %8llu %8llu\n",
+			stats_phase_name[i], stats_phase[i].wall_us / 1000.0,
+			stats_phase[i].sleep_us / 1000.0, h->count,
+			(unsigned long long)stats_percentile(h, 50),
+			(unsigned long long)stats_percentile(h, 99),
+			(unsigned long long)h->max_us);
+	}
+	printf("Stats: operations        count    busy ms   p50 us   p99 us   max us\n");
+	for (int i = 0; i < STATS_OPS; i++)
+		if (stats_op[i].count)
+			stats_print_hist(stats_op_name[i], &stats_op[i]);
+	printf("Stats: registers         count    busy ms   p50 us   p99 us   max us\n");
+	for (int i = 0; i < stats_reg_count; i++) {
+		if (stats_reg[i].op == STATS_OP_FRAME)
+			snprintf(name, sizeof(name), "frames");
+		else
+			snprintf(name, sizeof(name), "%s 0x%04x",
+				 stats_reg[i].op == STATS_OP_READ ? "read " : "write",
+				 stats_reg[i].reg);
+		stats_print_hist(name, &stats_reg[i].hist);
+	}
+	printf("Stats: sleeps            calls   total ms\n");
+	for (int i = 0; i < stats_site_count; i++) {
+		snprintf(name, sizeof(name), "%s:%d", stats_site[i].func,
+			 stats_site[i].line);
+		printf("  %-22s %7u %10.1f\n", name, stats_site[i].count,
+			stats_site[i].total_us / 1000.0);
+	}
+	fflush(stdout);
+}
+
 static int scan_i2c()
 {
     DIR* FD;
@@ -345,10 +1139,10 @@ static int scan_i2c()
 
             if (ioctl(dev_fd, I2C_SLAVE_FORCE, addr) >= 0)
             {
-		interface_type = I2C_INTERFACE;
+		elan_set_interface(I2C_INTERFACE);
 		if(extended_i2c_exercise)
 			printf("i2c device: %s \n", dev_name);
-                free(FD);	
+                closedir(FD);
                 return 1;
             }
         }
@@ -362,13 +1156,13 @@ static int scan_i2c()
 	    }
 	    if(extended_i2c_exercise)
 		printf("i2c device: %s \n", dev_name);
-	    interface_type = I2C_INTERFACE;
-            free(FD);	
+	    elan_set_interface(I2C_INTERFACE);
+            closedir(FD);
             return 1;
         }
         close(dev_fd);
     }
-    free(FD);	
+    closedir(FD);
     if(extended_i2c_exercise)
 	printf("scan_i2c -1\n");	
     return -1;
@@ -418,32 +1212,198 @@ static int scan_hid(int Vid, int Pid)
                     	printf("Bus type: %d\n", bus_type);
 		    }
 		    dev_fd = tmp_fd;
-		    interface_type = HID_INTERFACE;
+		    elan_set_interface(HID_INTERFACE);
 
 		    if(elan_read_cmd(ETP_I2C_IAP_CTRL_CMD)>=0)
 		    {
-			free(FD);	
+			closedir(FD);
                     	return 1;
                     }
                 }
             }
 
         }
+        close(tmp_fd);
     }
-    free(FD);	
+    closedir(FD);
     return 0;
 }
+/*
+ * sysfs discovery.  The kernel already knows the HID ids of every hidraw
+ * node and the name and address of every I2C client, so the matching
+ * node is picked from /sys and only that node is opened.  Returns 1 when
+ * the touchpad was opened, 0 when sysfs has no match and -1 when sysfs is
+ * not available and the /dev scan has to be used instead.
+ */
+#define SYSFS_HIDRAW_PATH               "/sys/class/hidraw/"
+#define SYSFS_I2C_PATH                  "/sys/bus/i2c/devices/"
+
+static int sysfs_read_line(const char *path, const char *key, char *out, int len)
+{
+	char line[256], *value;
+	FILE *fp = fopen(path, "r");
+	int found = -1;
+	size_t n;
+
+	if (!fp)
+		return -1;
+	while (fgets(line, sizeof(line), fp)) {
+		if (key && strncmp(line, key, strlen(key)))
+			continue;
+		line[strcspn(line, "\n")] = 0;
+		value = key ? line + strlen(key) : line;
+		/* Longer values are cut to the caller's buffer */
+		n = strlen(value);
+		if (n >= (size_t)len)
+			n = len - 1;
+		memcpy(out, value, n);
+		out[n] = 0;
+		found = 0;
+		break;
+	}
+	fclose(fp);
+	return found;
+}
+
+static int sysfs_find_hidraw(int Vid, int Pid)
+{
+	DIR *dir;
+	struct dirent *ent;
+	char path[PATH_MAX], value[256];
+	unsigned int bus, vendor, product;
+	int fd;
+
+	dir = opendir(SYSFS_HIDRAW_PATH);
+	if (!dir)
+		return -1;
+	while ((ent = readdir(dir))) {
+		if (strncmp(ent->d_name, HID_RAW_NAME, strlen(HID_RAW_NAME)))
+			continue;
+		snprintf(path, sizeof(path), "%s%s/device/uevent",
+			 SYSFS_HIDRAW_PATH, ent->d_name);
+		if (sysfs_read_line(path, "HID_ID=", value, sizeof(value)) ||
+		    sscanf(value, "%x:%x:%x", &bus, &vendor, &product) != 3)
+			continue;
+		if (vendor != (unsigned int)Vid || product != (unsigned int)Pid)
+			continue;
+
+		memset(raw_name, 0, sizeof(raw_name));
+		sysfs_read_line(path, "HID_NAME=", raw_name, sizeof(raw_name));
+		snprintf(path, sizeof(path), "%s%s", LINUX_DEV_PATH, ent->d_name);
+		fd = open(path, O_RDWR|O_NONBLOCK);
+		if (fd < 0) {
+			printf("Failed to open %s.\n", path);
+			continue;
+		}
+		bus_type = bus;
+		vid = vendor;
+		pid = product;
+		if (extended_i2c_exercise) {
+			printf("HID Raw Info\n");
+			printf("Raw name: %s\n", raw_name);
+			printf("Bus type: %d\n", bus_type);
+			printf("hid device: %s\n", path);
+		}
+		dev_fd = fd;
+		elan_set_interface(HID_INTERFACE);
+		if (elan_read_cmd(ETP_I2C_IAP_CTRL_CMD) >= 0) {
+			closedir(dir);
+			return 1;
+		}
+		close(fd);
+	}
+	closedir(dir);
+	return 0;
+}
+
+/*
+ * I2C clients show up either as ACPI devices ("i2c-ELAN0000:00") whose
+ * parent is the adapter, or as "<bus>-<addr>" for board-declared ones.
+ * Only clients with an ELAN name or ACPI id are candidates, and each one
+ * must answer an IAP control read before it is taken, so an unrelated
+ * device sharing the address is never claimed.
+ */
+static int sysfs_find_i2c(void)
+{
+	DIR *dir;
+	struct dirent *ent;
+	char path[PATH_MAX], real[PATH_MAX], name[256];
+	char *parent;
+	int bus, addr, n, fd;
+
+	dir = opendir(SYSFS_I2C_PATH);
+	if (!dir)
+		return -1;
+	while ((ent = readdir(dir))) {
+		if (ent->d_name[0] == '.')
+			continue;
+		/* Adapters, not clients */
+		n = 0;
+		if (sscanf(ent->d_name, I2C_NAME "%d%n", &bus, &n) == 1 &&
+		    ent->d_name[n] == 0)
+			continue;
+
+		snprintf(path, sizeof(path), "%s%s/name", SYSFS_I2C_PATH,
+			 ent->d_name);
+		if (sysfs_read_line(path, NULL, name, sizeof(name)))
+			name[0] = 0;
+
+		if (sscanf(ent->d_name, "%d-%x", &bus, &addr) == 2) {
+			if (!strstr(name, "ELAN") && !strstr(name, "elan"))
+				continue;
+		} else {
+			if (!strstr(ent->d_name, "ELAN") && !strstr(name, "ELAN"))
+				continue;
+			snprintf(path, sizeof(path), "%s%s", SYSFS_I2C_PATH,
+				 ent->d_name);
+			if (!realpath(path, real) || !(parent = strrchr(real, '/')))
+				continue;
+			*parent = 0;
+			parent = strrchr(real, '/');
+			if (!parent || sscanf(parent + 1, I2C_NAME "%d", &bus) != 1)
+				continue;
+			addr = i2caddr;
+		}
+
+		snprintf(path, sizeof(path), "%s%s%d", LINUX_DEV_PATH, I2C_NAME, bus);
+		fd = open(path, O_RDWR);
+		if (fd < 0) {
+			printf("Failed to open the i2c bus (%s).\n", path);
+			continue;
+		}
+		/* A bound kernel driver makes I2C_SLAVE fail with EBUSY */
+		if (ioctl(fd, I2C_SLAVE, addr) < 0 &&
+		    ioctl(fd, I2C_SLAVE_FORCE, addr) < 0) {
+			close(fd);
+			continue;
+		}
+		dev_fd = fd;
+		elan_set_interface(I2C_INTERFACE);
+		if (elan_read_cmd(ETP_I2C_IAP_CTRL_CMD) < 0) {
+			close(fd);
+			dev_fd = -1;
+			continue;
+		}
+		i2caddr = addr;
+		if (extended_i2c_exercise)
+			printf("i2c device: %s (%s, addr 0x%02x)\n", path,
+			       ent->d_name, addr);
+		closedir(dir);
+		return 1;
+	}
+	closedir(dir);
+	return 0;
+}
 static int assign_hidraw()
 {
         char dev_name[255];
         sprintf(dev_name, "%s%s%d", (char*)LINUX_DEV_PATH, 
 			(char*)HID_RAW_NAME, hidraw_num);
 	if ((dev_fd = open(dev_name, O_RDWR|O_NONBLOCK)) < 0) {
-	    request_exit("Can't open hidraw%d.\n", hidraw_num);
-            close(dev_fd);
+	    printf("Can't open hidraw%d.\n", hidraw_num);
 	    return -1;
         }
-	interface_type = HID_INTERFACE;
+	elan_set_interface(HID_INTERFACE);
 	return 0;
 
 }
@@ -463,13 +1423,13 @@ static int assign_i2c()
 
             if (ioctl(dev_fd, I2C_SLAVE_FORCE, addr) >= 0)
             {
-                interface_type = I2C_INTERFACE;
+                elan_set_interface(I2C_INTERFACE);
                 return 0;
             }
         }
         else
         {
-            interface_type = I2C_INTERFACE;
+            elan_set_interface(I2C_INTERFACE);
             return 0;
         }
 	
@@ -477,57 +1437,109 @@ static int assign_i2c()
 }
 static int init_with_hid(void)
 {
+	int ret = sysfs_find_hidraw(vid, pid);
 
-	if(scan_hid(vid, pid)){
-        	return 0;
-	}
-    	else{		
-	       	return -1;
-	}
+	if (ret < 0)
+		ret = scan_hid(vid, pid);
+	return ret > 0 ? 0 : -1;
 }
 static int init_with_i2c(void)
 {
-	if(scan_i2c())
-        	return 0 ;
-    	else
-	       	return -1;
+	int ret = sysfs_find_i2c();
+
+	if (ret < 0)
+		ret = scan_i2c();
+	return ret > 0 ? 0 : -1;
 }
-static void init_elan_tp(void)
+static int elan_cache_load(void);
+static void elan_cache_save(void);
+static int elan_discover(void)
 {
-	if(hidraw_num!=INITIAL_VALUE){
-		if(assign_hidraw()){
-			request_exit("Can't find ELAN TP.\n");
-		}
-		else
-			return;
+	if (sim_enabled) {
+		elan_set_interface(HID_INTERFACE);
+		dev_fd = -1;
+		return 0;
 	}
-	if(i2c_num!=INITIAL_VALUE){
-		if(assign_i2c()){
-			request_exit("Can't find ELAN TP.\n");
-		}
-		else
-			return;
+	if (replay_data) {
+		elan_set_interface(elan_replay_interface());
+		dev_fd = -1;
+		return 0;
 	}
+	if(hidraw_num!=INITIAL_VALUE)
+		return assign_hidraw();
+	if(i2c_num!=INITIAL_VALUE)
+		return assign_i2c();
 	if(init_with_hid()){
 		if(init_with_i2c()){
-			request_exit("Can't find ELAN TP.\n");
+			return -1;
 		}
 	}
+	return 0;
 }
-
-#define MAX_REC_SIZE 950
-
-int hid_read_block(unsigned char *rx, int rx_length)
+/* Returns 0 when the touchpad is open, -1 when none was found, -2 when busy */
+static int elan_open_tp(void)
 {
-    int res;
-    char *buf;
-    buf = (char*)malloc(rx_length+1);
-    memset(buf, 0x0, rx_length+1);
+	uint64_t start = elan_get_time_us();
+	int cached;
 
-    buf[0] = 0xC; /* Report Number */
-    res = ioctl(dev_fd, HIDIOCGFEATURE(rx_length), buf);
-    if (res < 0) {
-	free(buf);
+	elan_stats_phase(PHASE_DISCOVER);
+	cached = !elan_cache_load();
+
+	if (!cached) {
+		if (elan_discover() < 0) {
+			elan_stats_phase(-1);
+			return -1;
+		}
+		elan_cache_save();
+	}
+	/* One process talks to the part at a time, a daemon holds it for good */
+	if ((dev_fd >= 0) && (flock(dev_fd, LOCK_EX | LOCK_NB) < 0) &&
+	    (errno == EWOULDBLOCK)) {
+		elan_stats_phase(-1);
+		return -2;
+	}
+	if (trace_fd >= 0)
+		elan_trace(TRACE_OPEN, NULL, 0, interface_type, elan_get_time_us());
+	if (extended_i2c_exercise)
+		printf("Discovery: %s%s in %llu us\n", transport->name,
+		       cached ? " from cache" : "",
+		       (unsigned long long)(elan_get_time_us() - start));
+	elan_stats_phase(-1);
+	return 0;
+}
+static void init_elan_tp(void)
+{
+	switch (elan_open_tp()) {
+	case -1:
+		request_exit("Can't find ELAN TP.\n");
+	case -2:
+		request_exit("The touchpad is in use by another etphid_updater.\n");
+	}
+}
+
+static int hidraw_set_feature(uint8_t *buf, int len)
+{
+	return ioctl(dev_fd, HIDIOCSFEATURE(len), buf);
+}
+
+static int hidraw_get_feature(uint8_t *buf, int len)
+{
+	return ioctl(dev_fd, HIDIOCGFEATURE(len), buf);
+}
+
+int hid_read_block(unsigned char *rx, int rx_length)
+{
+    int res;
+    uint8_t *buf = session.block;
+    if (!transport->get_feature && !replay_data)
+	return -1;
+    if (rx_length > MAX_REC_SIZE)
+	rx_length = MAX_REC_SIZE;
+    memset(buf, 0x0, rx_length+1);
+
+    buf[0] = 0xC; /* Report Number */
+    res = elan_wire(TRACE_GET_FEATURE, buf, rx_length);
+    if (res < 0) {
 	return -1;
     }
     else {
@@ -540,7 +1552,6 @@ int hid_read_block(unsigned char *rx, int rx_length)
         if(rx_length==MAX_REC_SIZE)
             rx_length=rx[0] + (int)(rx[1] << 8);
     }
-    free(buf);	
     return 0;
 
 }
@@ -552,36 +1563,40 @@ static int hid_send_cmd(
 		unsigned char *rx, int rx_length)
 {
     int res;
-    char *buf;
-    buf = (char*)malloc(rx_length+3);
-    memset(buf, 0x0, rx_length+3);
+    uint8_t *buf;
+    size_t size;
 	
-    res = ioctl(dev_fd, HIDIOCSFEATURE(tx_length), tx);
+    res = elan_wire(TRACE_SET_FEATURE, tx, tx_length);
     if (res < 0){
 	if (extended_i2c_exercise) 
 		printf("Error: hid_send_cmd %x %x (SET)", tx[3], tx[4]);
-        free(buf);
 	return -1;
     }
     if(rx_length<=0)
-    {
-        free(buf);
         return 0;
+
+    /* Get Feature, straight into rx when it is rx_buf */
+    if (rx == rx_buf) {
+	buf = rx_report;
+	size = sizeof(rx_report);
+    } else {
+	buf = session.report;
+	size = sizeof(session.report);
     }
-    /* Get Feature */
+    if ((size_t)rx_length + ETP_HID_REPORT_HDR > size)
+	return -1;
+    memset(buf, 0x0, rx_length+3);
 
     buf[0] = tx[0]; /* Report Number */
-    res = ioctl(dev_fd, HIDIOCGFEATURE(rx_length+3), buf);
+    res = elan_wire(TRACE_GET_FEATURE, buf, rx_length+3);
     if (res < 0){
        if (extended_i2c_exercise) 
 		printf("Error: hid_send_cmd %x %x (GET)", tx[3], tx[4]);
-       free(buf);
        return -1;
     }
-    else{
+    else if (buf != rx_report){
         memcpy(&rx[0],&buf[3], rx_length );	
     }
-    free(buf);
     return 0;
 }
 
@@ -591,7 +1606,7 @@ static int i2c_send_cmd(
 {
     int res;
 
-    res = write(dev_fd, tx, tx_length);
+    res = elan_wire(TRACE_WRITE, tx, tx_length);
     if (res < 0){
 	if (extended_i2c_exercise) 
 		printf("Error: i2c_send_cmd %x %x (SET)", tx[0], tx[1]);
@@ -601,7 +1616,7 @@ static int i2c_send_cmd(
     if (rx_length<=0)
         return 0;
 
-    res = read(dev_fd, rx, rx_length);
+    res = elan_wire(TRACE_READ, rx, rx_length);
     if (res < 0){
        if (extended_i2c_exercise) 
 		printf("Error: i2c_send_cmd %x %x (GET)", rx[0], rx[1]);
@@ -634,9 +1649,9 @@ static int i2c_send_cmd_2(
     }
 
     if((tx_length==2)||(tx_length==4)) 
-    	res = write(dev_fd, buf, 13);
+    	res = elan_wire(TRACE_WRITE, (uint8_t *)buf, 13);
     else
-	res = write(dev_fd, tx, tx_length);
+	res = elan_wire(TRACE_WRITE, tx, tx_length);
 
     if (res < 0){
 	if (extended_i2c_exercise) 
@@ -647,14 +1662,14 @@ static int i2c_send_cmd_2(
     if (rx_length<=0)
         return 0; 
    
-    res = write(dev_fd, buf2, 6);
+    res = elan_wire(TRACE_WRITE, (uint8_t *)buf2, 6);
     if (res < 0){
 	if (extended_i2c_exercise) 
 		printf("Error: i2c_send_cmd_2 %x %x (SET)", tx[0], tx[1]);
 	return -2;
     }
 
-    res = read(dev_fd, buf3, rx_length + 5);
+    res = elan_wire(TRACE_READ, (uint8_t *)buf3, rx_length + 5);
     if (res < 0){
        if (extended_i2c_exercise) 
 		printf("Error: i2c_send_cmd_2 %x %x (GET)", buf3[5], buf3[6]);
@@ -704,35 +1719,55 @@ static int hid_write_cmd (unsigned char *tx, unsigned char *rx)
     return hid_send_cmd((unsigned char*)buf, 5, rx, 0);
 }
 
+static int i2c_read_cmd(unsigned char *tx, unsigned char *rx, int rx_length)
+{
+    return i2c_send_cmd(tx, 2, rx, rx_length);
+}
+static int i2c_write_cmd(unsigned char *tx, unsigned char *rx)
+{
+    return i2c_send_cmd(tx, 4, rx, 0);
+}
+static int hid_i2c_read_cmd(unsigned char *tx, unsigned char *rx, int rx_length)
+{
+    return i2c_send_cmd_2(tx, 2, rx, rx_length);
+}
+static int hid_i2c_write_cmd(unsigned char *tx, unsigned char *rx)
+{
+    return i2c_send_cmd_2(tx, 4, rx, 0);
+}
+
+
+
+static void elan_transport_account(uint64_t start, int op, int reg)
+{
+	uint64_t us = elan_get_time_us() - start;
 
+	transport->transactions++;
+	transport->busy_us += us;
+	if (stats_enabled)
+		elan_stats_command(op, reg, us);
+}
 
 static int elan_write_and_read(
 		int reg, uint8_t *buf, int read_length,
 		int with_cmd, int cmd)
 {
+	uint64_t start = elan_get_time_us();
+	int ret;
+
 	tx_buf[0] = (reg >> 0) & 0xff;
 	tx_buf[1] = (reg >> 8) & 0xff;
 
 	if (with_cmd) {
 		tx_buf[2] = (cmd >> 0) & 0xff;
 		tx_buf[3] = (cmd >> 8) & 0xff;
-		if (interface_type==HID_INTERFACE)
-			return hid_write_cmd(tx_buf,  buf);
-		else if (interface_type==HID_I2C_INTERFACE)
-			return i2c_send_cmd_2(tx_buf, 4, buf, 0);
-		else
-			return i2c_send_cmd(tx_buf, 4, buf, 0);
+		ret = transport->write_cmd(tx_buf, buf);
 	}
 	else
-	{
-		if (interface_type==HID_INTERFACE)
-			return hid_read_cmd(tx_buf, buf, read_length);
-		else if (interface_type==HID_I2C_INTERFACE)
-			return i2c_send_cmd_2(tx_buf, 2, buf, read_length);
-		else
-			return i2c_send_cmd(tx_buf, 2, buf, read_length);
-	}	
+		ret = transport->read_cmd(tx_buf, buf, read_length);
 
+	elan_transport_account(start, with_cmd ? STATS_OP_WRITE : STATS_OP_READ, reg);
+	return ret;
 }
 
 static int elan_read_cmd(int reg)
@@ -860,10 +1895,12 @@ static uint16_t elan_get_fw_info(void)
 	uint16_t fw_checksum = 0xffff;
 
 	printf("Querying device info...\n");
-	is_new_pattern = elan_get_patten();
+	if (!identity_cached)
+		is_new_pattern = elan_get_patten();
 	//printf("is_new_pattern = %x\n", is_new_pattern);
 	fw_checksum = elan_get_checksum(0);
 	iap_checksum = elan_get_checksum(1);
+	device_iap_checksum = iap_checksum;
 	fw_version = elan_get_version(0);
 	iap_version = elan_get_version(1);
 	printf("IAP  version: %4x, FW  version: %4x\n",
@@ -905,6 +1942,100 @@ static int elan_get_iap_ctrl(void)
 	elan_read_cmd(ETP_I2C_IAP_CTRL_CMD);
 	return le_bytes_to_int(rx_buf);
 }
+
+/*
+ * Mode transitions.  Resets and the IAP password are followed by delays
+ * sized for the slowest part.  In poll mode the delay is only an upper
+ * bound: the state the next step needs is polled with a doubling step
+ * and the wait ends as soon as it shows up.  A part that never gets there
+ * waits the full delay, as it always did.  Disabling reports keeps its
+ * fixed settle time, since no register shows when reports have stopped.
+ */
+#define ETP_READY_INITIAL_US		1000
+#define ETP_READY_MAX_STEP_US		16000
+
+enum {
+	READY_RESET,		/* main mode after a reset */
+	READY_FLASH,		/* main mode after the last page */
+	READY_EEPROM,		/* main mode after an EEPROM update */
+	READY_PASSWORD,		/* IAP password accepted */
+	READY_COUNT
+};
+
+static struct {
+	const char *name;
+	unsigned int count;
+	unsigned int timeouts;
+	uint64_t total_us;
+	uint64_t max_us;
+} ready_stats[READY_COUNT] = {
+	{ "reset" },
+	{ "flash reset" },
+	{ "eeprom reset" },
+	{ "iap password" },
+};
+
+static int elan_ready(int transition)
+{
+	int ctrl;
+
+	if (elan_read_cmd(ETP_I2C_IAP_CTRL_CMD))
+		return 0;
+	ctrl = le_bytes_to_int(rx_buf);
+	if (ctrl == 0xFFFF)
+		return 0;
+	if (transition == READY_PASSWORD)
+		return (ctrl & ETP_FW_IAP_CHECK_PW) != 0;
+	return (ctrl & ETP_I2C_MAIN_MODE_ON) &&
+		(elan_read_cmd(ETP_I2C_FW_VERSION_CMD) == 0);
+}
+
+static void elan_wait_ready(int transition, int bound_us)
+{
+	uint64_t start, deadline, now;
+	int step = ETP_READY_INITIAL_US;
+	int ready;
+
+	if (!poll_mode) {
+		SLEEP(bound_us);
+		return;
+	}
+
+	start = elan_get_time_us();
+	deadline = start + bound_us;
+	for (;;) {
+		SLEEP(step);
+		ready = elan_ready(transition);
+		now = elan_get_time_us();
+		if (ready || (now >= deadline))
+			break;
+		step *= 2;
+		if (step > ETP_READY_MAX_STEP_US)
+			step = ETP_READY_MAX_STEP_US;
+		if (now + step > deadline)
+			step = deadline - now;
+	}
+	ready_stats[transition].count++;
+	ready_stats[transition].timeouts += !ready;
+	ready_stats[transition].total_us += now - start;
+	if (now - start > ready_stats[transition].max_us)
+		ready_stats[transition].max_us = now - start;
+}
+
+static void elan_print_ready(void)
+{
+	for (int i = 0; i < READY_COUNT; i++) {
+		if (!ready_stats[i].count)
+			continue;
+		printf("Ready (IC type %02x): %-14s %u x, avg %.1f ms, max %.1f ms",
+			ic_type & 0xFF, ready_stats[i].name, ready_stats[i].count,
+			ready_stats[i].total_us / 1000.0 / ready_stats[i].count,
+			ready_stats[i].max_us / 1000.0);
+		if (ready_stats[i].timeouts)
+			printf(", %u timed out", ready_stats[i].timeouts);
+		printf("\n");
+	}
+}
 static int elan_get_iap_icbody_interfacetype()
 {
     	elan_read_cmd(ETP_I2C_IAP_ICBODY_CMD);
@@ -922,11 +2053,9 @@ static int elan_get_ic_type(void)
 
 
 
-static int elan_get_ic_page_count(void)
+static int elan_ic_type_page_count(uint8_t type)
 {
-	ic_type = elan_get_ic_type();
-	
-	switch (ic_type) {
+	switch (type) {
 	//case 0x00:
 	case 0x06:
 	case 0x08:
@@ -960,13 +2089,23 @@ static int elan_get_ic_page_count(void)
 	case 0x15:
 		return 1024;
 		break;
-	default:
-		request_exit("The IC type is not supported (%x).\n", ic_type);
 	}
 	return -1;
 }
+static int elan_get_ic_page_count(void)
+{
+	if (!identity_cached)
+		ic_type = elan_get_ic_type();
+
+	int page_count = elan_ic_type_page_count(ic_type);
+	if (page_count < 0)
+		request_exit("The IC type is not supported (%x).\n", ic_type);
+	return page_count;
+}
+static void elan_cache_invalidate(void);
 static void elan_reset_tp(void)
 {
+	elan_cache_invalidate();
 	elan_write_cmd(ETP_I2C_IAP_RESET_CMD, ETP_I2C_IAP_RESET);
 }
 
@@ -985,13 +2124,13 @@ static void switch_to_ptpmode()
 {
 	if(elan_write_cmd(ETP_I2C_IAP_RESET_CMD, ETP_I2C_ENABLE_REPORT))
 	{
-		usleep(20 * 1000);
+		SLEEP(20 * 1000);
 		if(elan_write_cmd(ETP_I2C_IAP_RESET_CMD, ETP_I2C_ENABLE_REPORT))
 			printf("Can't enable TP report.\n");
 	}
 	if(elan_write_cmd(0x0306, 0x003))
 	{
-		usleep(20 * 1000);
+		SLEEP(20 * 1000);
 		if(elan_write_cmd(0x0306, 0x003))
 			printf("Can't switch to TP PTP mode.\n");
 	}
@@ -1001,7 +2140,7 @@ static void disable_report()
 {
 	if(elan_write_cmd(ETP_I2C_IAP_RESET_CMD, ETP_I2C_DISABLE_REPORT))
 		printf("Can't disable TP report.\n");
-	usleep(50 * 1000);
+	SLEEP(50 * 1000);
 
 }
 #define ETP_I2C_REGION_CMD 	0x0500
@@ -1014,7 +2153,7 @@ static int elan_get_region_code ()
 {
 	int ret = elan_read_cmd(ETP_I2C_REGION_CMD);
 	if (ret) {
-		usleep(20 * 1000);
+		SLEEP(20 * 1000);
 		ret = elan_read_cmd(ETP_I2C_REGION_CMD);
 		if (ret)
 			return -4;
@@ -1048,7 +2187,7 @@ static int elan_set_region_code (int region)
 	
 	ret = elan_write_cmd(ETP_I2C_IAP_CMD, ETP_I2C_FLASH_REGION);
 	if(ret) {
-		usleep(20 * 1000);
+		SLEEP(20 * 1000);
 		ret = elan_write_cmd(ETP_I2C_IAP_CMD, ETP_I2C_FLASH_REGION);	
 		if (ret)
 			return -7;
@@ -1063,7 +2202,7 @@ static int elan_set_region_code (int region)
 	case CODE_FR:	//FR
 		ret = elan_write_cmd(ETP_I2C_REGION_CMD, ETP_I2C_REGION_FR);
 		if(ret) {
-			usleep(50 * 1000);
+			SLEEP(50 * 1000);
 			ret = elan_write_cmd(ETP_I2C_REGION_CMD, ETP_I2C_REGION_FR);	
 			if (ret)
 				return -9;
@@ -1072,7 +2211,7 @@ static int elan_set_region_code (int region)
 	case CODE_CZ:	//CZ
 		ret = elan_write_cmd(ETP_I2C_REGION_CMD, ETP_I2C_REGION_CZ);
 		if(ret) {
-			usleep(50 * 1000);
+			SLEEP(50 * 1000);
 			ret = elan_write_cmd(ETP_I2C_REGION_CMD, ETP_I2C_REGION_CZ);	
 			if (ret)
 				return -9;
@@ -1081,14 +2220,14 @@ static int elan_set_region_code (int region)
 	default:	//Other
 		ret = elan_write_cmd(ETP_I2C_REGION_CMD, 0xFFFF);
 		if(ret) {
-			usleep(50 * 1000);
+			SLEEP(50 * 1000);
 			ret = elan_write_cmd(ETP_I2C_REGION_CMD, 0xFFFF);	
 			if (ret)
 				return -9;
 	    	}
 		break;
 	}
-	usleep(50 * 1000);
+	SLEEP(50 * 1000);
 	return ret;
 
 }
@@ -1098,7 +2237,14 @@ static int elan_set_region_code (int region)
 #define ETP_IAP_VER_ADDR		0x0082
 #define ETP_IAP_FLIMFORCE_ADDR_V5	0x0085
 
-static uint16_t elan_calc_checksum(uint8_t *data, int length)
+/*
+ * Checksum kernels.  The IAP checksum is a sum of little-endian words and
+ * the EEPROM checksum a sum of bytes, both modulo 2^16.  16-bit lane adds
+ * wrap the same way, so the vector word sum is exact; the byte sum goes
+ * through SAD against zero.  The kernel is picked once from the CPU
+ * features, and every kernel finishes odd tails with the scalar loop.
+ */
+static uint16_t elan_word_sum_scalar(const uint8_t *data, int length)
 {
 	uint16_t checksum = 0;
 	int i;
@@ -1106,966 +2252,3925 @@ static uint16_t elan_calc_checksum(uint8_t *data, int length)
 		checksum += ((uint16_t)(data[i+1]) << 8) | (data[i]);
 	return checksum;
 }
-static uint16_t elan_eeprom_calc_checksum(uint8_t *data, int length)
+
+static uint16_t elan_byte_sum_scalar(const uint8_t *data, int length)
 {
 	uint16_t checksum = 0;
 	for (int i = 0; i < length; i ++)
 		checksum += (data[i]);
 	return checksum;
 }
-static int elan_get_iap_addr(void)
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+__attribute__((target("sse2")))
+static uint16_t elan_word_sum_sse2(const uint8_t *data, int length)
 {
-	return le_bytes_to_int(fw_data + ETP_IAP_START_ADDR * 2) * 2;
+	__m128i acc = _mm_setzero_si128();
+	uint16_t lanes[8], checksum = 0;
+	int i;
+
+	for (i = 0; i + 16 <= length; i += 16)
+		acc = _mm_add_epi16(acc, _mm_loadu_si128((const __m128i *)(data + i)));
+	_mm_storeu_si128((__m128i *)lanes, acc);
+	for (int l = 0; l < 8; l++)
+		checksum += lanes[l];
+	return checksum + elan_word_sum_scalar(data + i, length - i);
 }
-static int elan_get_fw_module_id(void)
+
+__attribute__((target("sse2")))
+static uint16_t elan_byte_sum_sse2(const uint8_t *data, int length)
 {
-	int start_addr = elan_get_iap_addr();
-	int unique_addr = le_bytes_to_int(fw_data + start_addr) * 2;
-	return le_bytes_to_int(fw_data + unique_addr);
+	__m128i acc = _mm_setzero_si128(), zero = _mm_setzero_si128();
+	uint64_t lanes[2];
+	int i;
+
+	for (i = 0; i + 16 <= length; i += 16)
+		acc = _mm_add_epi64(acc, _mm_sad_epu8(
+			_mm_loadu_si128((const __m128i *)(data + i)), zero));
+	_mm_storeu_si128((__m128i *)lanes, acc);
+	return (uint16_t)(lanes[0] + lanes[1]) + elan_byte_sum_scalar(data + i, length - i);
 }
-static int elan_get_fw_iap_ver(void)
+
+__attribute__((target("avx2")))
+static uint16_t elan_word_sum_avx2(const uint8_t *data, int length)
 {
-	return le_bytes_to_int(fw_data + ETP_IAP_VER_ADDR * 2) ;
+	__m256i acc = _mm256_setzero_si256();
+	uint16_t lanes[16], checksum = 0;
+	int i;
+
+	for (i = 0; i + 32 <= length; i += 32)
+		acc = _mm256_add_epi16(acc, _mm256_loadu_si256((const __m256i *)(data + i)));
+	_mm256_storeu_si256((__m256i *)lanes, acc);
+	for (int l = 0; l < 16; l++)
+		checksum += lanes[l];
+	return checksum + elan_word_sum_scalar(data + i, length - i);
 }
-static int elan_get_fw_flimforce_addr()
+
+__attribute__((target("avx2")))
+static uint16_t elan_byte_sum_avx2(const uint8_t *data, int length)
 {
-	if(iap_version<=4) {
-		int start_addr = elan_get_iap_addr();
-		return (le_bytes_to_int(fw_data + start_addr + 6) * 2);
-	}
-	else
-		return le_bytes_to_int(fw_data + ETP_IAP_FLIMFORCE_ADDR_V5 * 2) * 2;
+	__m256i acc = _mm256_setzero_si256(), zero = _mm256_setzero_si256();
+	uint64_t lanes[4];
+	int i;
+
+	for (i = 0; i + 32 <= length; i += 32)
+		acc = _mm256_add_epi64(acc, _mm256_sad_epu8(
+			_mm256_loadu_si256((const __m256i *)(data + i)), zero));
+	_mm256_storeu_si256((__m256i *)lanes, acc);
+	return (uint16_t)(lanes[0] + lanes[1] + lanes[2] + lanes[3]) +
+		elan_byte_sum_scalar(data + i, length - i);
 }
-static int elan_get_flimforce_addr()
+#endif
+
+static uint16_t (*elan_word_sum)(const uint8_t *data, int length);
+static uint16_t (*elan_byte_sum)(const uint8_t *data, int length);
+static const char *elan_checksum_kernel = "scalar";
+
+static void elan_select_checksum_kernels(void)
 {
-    if(iap_version==0x3)
-    {
-    	if((module_id==0x130)||(module_id==0x133))
-    		return 0xFF40 * 2;
-    	else
-    		return -3;
-    }
-    	
-    if((ic_type==0x13)&&(iap_version>=5)) {
-	    elan_read_cmd(ETP_I2C_FLIMFORCE_ADDR_CMD);
-	    return le_bytes_to_int(rx_buf)  * 2;
-    }
-    
-    return -1;
+	elan_word_sum = elan_word_sum_scalar;
+	elan_byte_sum = elan_byte_sum_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		elan_word_sum = elan_word_sum_avx2;
+		elan_byte_sum = elan_byte_sum_avx2;
+		elan_checksum_kernel = "avx2";
+	} else if (__builtin_cpu_supports("sse2")) {
+		elan_word_sum = elan_word_sum_sse2;
+		elan_byte_sum = elan_byte_sum_sse2;
+		elan_checksum_kernel = "sse2";
+	}
+#endif
 }
-static void elan_calc_fw_flimforce_checksum()
-{
-    fw_flimforce_area_checksum = 0;
-    for(int i = fw_flimforce_addr; i< fw_size_all; i+=2) {
-    	fw_flimforce_area_checksum += elan_calc_checksum(fw_data + i, 2);
-    }
 
+static uint16_t elan_calc_checksum(const uint8_t *data, int length)
+{
+	if (!elan_word_sum)
+		elan_select_checksum_kernels();
+	return elan_word_sum(data, length);
 }
-static int elan_check_flimforeaddr_legal(int addrw)
+static uint16_t elan_eeprom_calc_checksum(const uint8_t *data, int length)
 {
-   if(addrw%32==0)
-	return 0;
-   else 
-   	return -1;	
-
+	if (!elan_byte_sum)
+		elan_select_checksum_kernels();
+	return elan_byte_sum(data, length);
 }
 
-#define ETP_I2C_IAP_REG_L		0x01
-#define ETP_I2C_IAP_REG_H		0x06
-
-#define ETP_FW_IAP_PAGE_ERR		(1 << 5)
-#define ETP_FW_IAP_INTF_ERR		(1 << 4)
+/*
+ * --selftest: every vector kernel the CPU runs must give the scalar sums
+ * on random data and on all-0xFF data (the worst case for lane and SAD
+ * carries), at every alignment within 32 bytes and at random lengths up
+ * to a whole 128 KiB image.  Word sums take even lengths only, as the
+ * IAP data always is.  Returns 0 when every kernel agrees.
+ */
+#define SELFTEST_ROUNDS			4000
+#define SELFTEST_MAX_LEN		(128 * 1024)
 
-static int check_fw_signature()
+static int elan_checksum_selftest(void)
 {
+	struct {
+		const char *name;
+		uint16_t (*word)(const uint8_t *data, int length);
+		uint16_t (*byte)(const uint8_t *data, int length);
+		int usable;
+	} kernels[] = {
+#if defined(__x86_64__) || defined(__i386__)
+		{ "sse2", elan_word_sum_sse2, elan_byte_sum_sse2,
+		  __builtin_cpu_supports("sse2") },
+		{ "avx2", elan_word_sum_avx2, elan_byte_sum_avx2,
+		  __builtin_cpu_supports("avx2") },
+#endif
+		{ NULL, NULL, NULL, 0 },
+	};
+	uint8_t *buf = malloc(SELFTEST_MAX_LEN + 32);
+	uint32_t seed = 0x2545F491;
+	int failures = 0, tested = 0;
+
+	if (!buf)
+		request_exit("Out of memory for the self-test\n");
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+#endif
+	for (int round = 0; round < SELFTEST_ROUNDS; round++) {
+		int align, len;
+
+		/* xorshift32, so every run checks the same buffers */
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+		align = seed % 32;
+		len = (round < 8) ? SELFTEST_MAX_LEN - (round % 4) :
+			(round % 2) ? (int)((seed >> 5) % 4097) :
+			(int)((seed >> 5) % (SELFTEST_MAX_LEN + 1));
+		if (round % 4 == 0) {
+			memset(buf, 0xFF, SELFTEST_MAX_LEN + 32);
+		} else {
+			for (int i = 0; i < SELFTEST_MAX_LEN + 32; i += 4) {
+				seed ^= seed << 13;
+				seed ^= seed >> 17;
+				seed ^= seed << 5;
+				memcpy(buf + i, &seed, 4);
+			}
+		}
 
-	static const uint8_t signature[] = {0xAA, 0x55, 0xCC, 0x33, 0xFF, 0xFF};
-	/* Firmware file must match signature data */
-	for(int i=0; i< sizeof(signature); i++)
-	{
-		if(fw_data[fw_signature_address+i]!=signature[i]) {
-			printf("signature mismatch (expected %x, got %x)\n",signature[i], fw_data[fw_signature_address+i]);
-			return -1;
+		const uint8_t *data = buf + align;
+		uint16_t word = elan_word_sum_scalar(data, len & ~1);
+		uint16_t byte = elan_byte_sum_scalar(data, len);
+
+		for (int k = 0; kernels[k].name; k++) {
+			if (!kernels[k].usable)
+				continue;
+			if (kernels[k].word(data, len & ~1) != word) {
+				printf("Self-test: %s word sum of %d bytes at +%d is %04x, "
+				       "expected %04x\n", kernels[k].name, len & ~1, align,
+				       kernels[k].word(data, len & ~1), word);
+				failures++;
+			}
+			if (kernels[k].byte(data, len) != byte) {
+				printf("Self-test: %s byte sum of %d bytes at +%d is %04x, "
+				       "expected %04x\n", kernels[k].name, len, align,
+				       kernels[k].byte(data, len), byte);
+				failures++;
+			}
 		}
+		tested++;
 	}
+	free(buf);
 
-	return 0;
+	printf("Self-test: scalar");
+	for (int k = 0; kernels[k].name; k++)
+		printf(", %s%s", kernels[k].name, kernels[k].usable ? "" : " (not supported)");
+	printf(" checksum kernels on %d buffers: %s\n", tested,
+	       failures ? "FAIL" : "PASS");
+	return failures ? 1 : 0;
 }
-static void elan_get_iap_fw_page_size(void)
-{
-	fw_page_size = 64; 
-	fw_section_size = 64;
-	fw_no_of_sections = 1;
-    	if(ic_type>=0x10)
-    	{
-        	if(iap_version>=1)
-        	{
+/*
+ * Compressed images.  A file that starts with the gzip magic (1f 8b) is
+ * inflated in one pass from its mapping into the image reservation, and
+ * the CRC32 and length in the gzip trailer must match before the image
+ * is used, so a damaged download fails before any device I/O.  The
+ * decoder follows RFC 1951 (stored, fixed and dynamic Huffman blocks)
+ * and keeps its code tables on the stack.
+ */
+#define GZIP_ID1			0x1f
+#define GZIP_ID2			0x8b
+#define GZIP_CM_DEFLATE			8
+#define GZIP_FHCRC			0x02
+#define GZIP_FEXTRA			0x04
+#define GZIP_FNAME			0x08
+#define GZIP_FCOMMENT			0x10
+#define INFLATE_MAX_BITS		15
+#define INFLATE_MAX_LCODES		286
+#define INFLATE_MAX_DCODES		30
+#define INFLATE_FIX_LCODES		288
+
+struct inflate_state {
+	const uint8_t *in;
+	size_t in_len;
+	size_t in_pos;
+	uint32_t bitbuf;
+	int bitcnt;
+	int err;
+	uint8_t *out;
+	size_t out_len;
+	size_t out_pos;
+};
 
-            		if((iap_version>=2)&&((ic_type==0x14)||(ic_type==0x15)))
-            		{
-                		fw_page_size = 512;
-				if(iap_version>=3)
-				{
-					fw_section_size = elan_get_iap_type() * 2;
-					fw_no_of_sections = fw_page_size / fw_section_size;
-				}
-				else
-					fw_section_size = 512;
-            		}
-            		else
-			{
-                		fw_page_size = 128; 
-				fw_section_size = 128;
-			}
-			if(fw_section_size == fw_page_size) {
-				elan_write_cmd(ETP_I2C_IAP_TYPE_CMD, fw_section_size / 2);
-				int iap_type = elan_get_iap_type();
-				if((iap_type & 0xFFFF)!= ((fw_section_size / 2)& 0xFFFF))
-		    		{
-		      
-		        		elan_write_cmd(ETP_I2C_IAP_TYPE_CMD, fw_section_size / 2);
-					iap_type = elan_get_iap_type();
-		        		if((iap_type & 0xFFFF)!= ((fw_section_size / 2)& 0xFFFF))
-		        		{			
-						elan_reset_tp();
-						switch_to_ptpmode();
-						request_exit("Read/Wirte IAP Type Command FAIL!!\n");
-		        		}
-		    		}
-			}
+struct inflate_huffman {
+	uint16_t count[INFLATE_MAX_BITS + 1];	/* codes per length */
+	uint16_t symbol[INFLATE_FIX_LCODES];	/* symbols by code */
+};
 
+static const char *inflate_error;
 
-        	}
-	}
+static int inflate_bits(struct inflate_state *s, int need)
+{
+	uint32_t val = s->bitbuf;
 
+	while (s->bitcnt < need) {
+		if (s->in_pos >= s->in_len) {
+			s->err = 1;
+			return 0;
+		}
+		val |= (uint32_t)s->in[s->in_pos++] << s->bitcnt;
+		s->bitcnt += 8;
+	}
+	s->bitbuf = val >> need;
+	s->bitcnt -= need;
+	return val & ((1u << need) - 1);
 }
-static int elan_write_password(int pw)
+
+static int inflate_decode(struct inflate_state *s, const struct inflate_huffman *h)
 {
-    if(elan_write_cmd(ETP_I2C_PASSWORD_CMD, pw)) {
-	usleep(20 * 1000);
-	return elan_write_cmd(ETP_I2C_PASSWORD_CMD, pw);	
-    }
-    return 0;
+	int code = 0, first = 0, index = 0;
+
+	for (int len = 1; len <= INFLATE_MAX_BITS; len++) {
+		code |= inflate_bits(s, 1);
+		int count = h->count[len];
+		if (code - count < first)
+			return h->symbol[index + (code - first)];
+		index += count;
+		first = (first + count) << 1;
+		code <<= 1;
+	}
+	return -1;
 }
-static int elan_set_password()
-{ 
-    int pw=0;
-    if(iap_version<0) {
-    	is_new_pattern = elan_get_patten();
-	iap_version = elan_get_version(1);
-    }
-    
-    if(ic_type<=0) 
-    	ic_type = elan_get_ic_type();
-    	
-    if((iap_version>=5)&&(ic_type==0x13))
-    	pw = ETP_I2C_IC13_IAPV5_PW & 0xFFFF;
-    else
-    	return 0;
-   
-    for(int i=0; i<3; i++) {
-    	int rv=-1;
-    	rv = elan_write_password(pw);
-    	if(rv < 0)
-    		return -1;
-			
-    	rv=-1;
-    	elan_read_cmd(ETP_I2C_PASSWORD_CMD);
-    	rv = le_bytes_to_int(rx_buf);
-		    
-    	if(rv==pw)
-    		return 0;
-    }
-    return -2;
 
+/* Returns 0 for a complete code, > 0 for an incomplete one, < 0 if oversubscribed */
+static int inflate_build(struct inflate_huffman *h, const uint8_t *length, int n)
+{
+	uint16_t offs[INFLATE_MAX_BITS + 1];
+	int left = 1;
+
+	memset(h->count, 0, sizeof(h->count));
+	for (int i = 0; i < n; i++)
+		h->count[length[i]]++;
+	if (h->count[0] == n)
+		return 0;
+	for (int len = 1; len <= INFLATE_MAX_BITS; len++) {
+		left = (left << 1) - h->count[len];
+		if (left < 0)
+			return left;
+	}
+	offs[1] = 0;
+	for (int len = 1; len < INFLATE_MAX_BITS; len++)
+		offs[len + 1] = offs[len] + h->count[len];
+	for (int i = 0; i < n; i++)
+		if (length[i])
+			h->symbol[offs[length[i]]++] = i;
+	return left;
 }
-static int filling_flimfore_area()
+
+static int inflate_stored(struct inflate_state *s)
 {
-	static const uint8_t fillature[] = {0x77, 0x33, 0x44, 0xaa};
-	static const uint8_t signature[] = {0xAA, 0x55, 0xCC, 0x33, 0xFF, 0xFF};
+	size_t len;
 
-	if(fw_size_all<=0)
+	/* Skip to the byte boundary, the rest of the current byte is padding */
+	s->bitbuf = 0;
+	s->bitcnt = 0;
+	if (s->in_pos + 4 > s->in_len)
 		return -1;
+	len = s->in[s->in_pos] | (s->in[s->in_pos + 1] << 8);
+	if ((s->in[s->in_pos + 2] != (~len & 0xff)) ||
+	    (s->in[s->in_pos + 3] != ((~len >> 8) & 0xff)))
+		return -1;
+	s->in_pos += 4;
+	if ((s->in_pos + len > s->in_len) || (s->out_pos + len > s->out_len))
+		return -1;
+	memcpy(s->out + s->out_pos, s->in + s->in_pos, len);
+	s->in_pos += len;
+	s->out_pos += len;
+	return 0;
+}
 
-	if(fw_flimforce_addr<=0)
-		return -2;
-
-	if(flimforce_addr<=0)
-		return -3;
-
-	int size = flimforce_addr - fw_flimforce_addr;
-	if(size%64!=0)
-		return -4;
-	
-	for(int i=fw_flimforce_addr; i< flimforce_addr; i+=64)
-	{
-		for(int j=i; j< i+64; j++)
-			fw_data[j] = 0xFF;
-			
-		for(int l=0; l< sizeof(fillature); l++)
-			fw_data[l+i] = fillature[l];
-		
-		fw_data[i+4] = (flimforce_addr/2) & 0xFF;
-		fw_data[i+5] = ((flimforce_addr/2) >> 8) & 0xFF;
-		
-		for(int k=0; k< sizeof(signature); k++)
-			fw_data[i+64-6+k] = signature[k];
-			
-		uint16_t block_checksum = elan_calc_checksum(fw_data + i, 64) - 0xFFFF;
-		uint16_t filling_value = 0x10000 - (block_checksum & 0xFFFF);
-		fw_data[i+6] = filling_value & 0xFF;
-		fw_data[i+7] = (filling_value >> 8) & 0xFF;
+static int inflate_codes(struct inflate_state *s, const struct inflate_huffman *lencode,
+			 const struct inflate_huffman *distcode)
+{
+	static const uint16_t len_base[29] = {
+		3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+		35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+	static const uint8_t len_extra[29] = {
+		0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+		3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+	static const uint16_t dist_base[30] = {
+		1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+		257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+		8193, 12289, 16385, 24577 };
+	static const uint8_t dist_extra[30] = {
+		0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+		7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+	int symbol;
+
+	for (;;) {
+		symbol = inflate_decode(s, lencode);
+		if ((symbol < 0) || s->err)
+			return -1;
+		if (symbol == 256)
+			return 0;
+		if (symbol < 256) {
+			if (s->out_pos >= s->out_len)
+				return -1;
+			s->out[s->out_pos++] = symbol;
+			continue;
+		}
+		symbol -= 257;
+		if (symbol >= 29)
+			return -1;
+		size_t len = len_base[symbol] + inflate_bits(s, len_extra[symbol]);
+		symbol = inflate_decode(s, distcode);
+		if ((symbol < 0) || (symbol >= 30))
+			return -1;
+		size_t dist = dist_base[symbol] + inflate_bits(s, dist_extra[symbol]);
+		if (s->err || (dist > s->out_pos) || (s->out_pos + len > s->out_len))
+			return -1;
+		/* Byte by byte, the copy may overlap what it produces */
+		for (; len; len--, s->out_pos++)
+			s->out[s->out_pos] = s->out[s->out_pos - dist];
 	}
-	return size;
 }
-static void elan_prepare_flimforce_area(void)
+
+static int inflate_fixed(struct inflate_state *s)
 {
-	fw_flimforce_addr = elan_get_fw_flimforce_addr();
-	flimforce_addr = elan_get_flimforce_addr();
-	
-	if(flimforce_addr==-3)
-		flimforce_addr = fw_flimforce_addr;
+	struct inflate_huffman lencode, distcode;
+	uint8_t length[INFLATE_FIX_LCODES];
+	int i;
 
-	printf("ForceTBLaddr: %4x, Frombinaddr: %4x\n",
-			flimforce_addr/2, fw_flimforce_addr/2);
-				
-	if(flimforce_addr < fw_flimforce_addr)
-	{
-		switch_to_ptpmode();
-		request_exit("The Flimforce area can't filling.\n");
-	}
-	int ret = elan_check_flimforeaddr_legal(flimforce_addr/2);
-	if (ret<0)
-	{
-		switch_to_ptpmode();
-		request_exit("The Flimforce address is illegal.\n");
-	}
-	ret = elan_check_flimforeaddr_legal(fw_flimforce_addr/2);
-	if (ret<0)
-	{
-		switch_to_ptpmode();
-		request_exit("The FW Flimforce address is illegal.\n");
-	}
-	
-	int new_fw_size = flimforce_addr;
-	fw_size_all = fw_size;
-	fw_size = new_fw_size - 1;
-	fw_signature_address = new_fw_size - FW_SIGNATURE_SIZE;
+	for (i = 0; i < 144; i++)
+		length[i] = 8;
+	for (; i < 256; i++)
+		length[i] = 9;
+	for (; i < 280; i++)
+		length[i] = 7;
+	for (; i < INFLATE_FIX_LCODES; i++)
+		length[i] = 8;
+	inflate_build(&lencode, length, INFLATE_FIX_LCODES);
+	for (i = 0; i < INFLATE_MAX_DCODES; i++)
+		length[i] = 5;
+	inflate_build(&distcode, length, INFLATE_MAX_DCODES);
+	return inflate_codes(s, &lencode, &distcode);
+}
 
-	elan_calc_fw_flimforce_checksum();
-	if(flimforce_addr > fw_flimforce_addr)
-	{
-		if(filling_flimfore_area()<0)
-		{
-			switch_to_ptpmode();
-			request_exit("The Flimforce area filling error.\n");
+static int inflate_dynamic(struct inflate_state *s)
+{
+	static const uint8_t order[19] = {
+		16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+	struct inflate_huffman lencode, distcode;
+	uint8_t length[INFLATE_MAX_LCODES + INFLATE_MAX_DCODES];
+	int nlen = inflate_bits(s, 5) + 257;
+	int ndist = inflate_bits(s, 5) + 1;
+	int ncode = inflate_bits(s, 4) + 4;
+	int index, err;
+
+	if (s->err || (nlen > INFLATE_MAX_LCODES) || (ndist > INFLATE_MAX_DCODES))
+		return -1;
+	memset(length, 0, sizeof(length));
+	for (index = 0; index < ncode; index++)
+		length[order[index]] = inflate_bits(s, 3);
+	if (inflate_build(&lencode, length, 19) != 0)
+		return -1;
+
+	for (index = 0; index < nlen + ndist; ) {
+		int symbol = inflate_decode(s, &lencode);
+		int value = 0, repeat;
+
+		if ((symbol < 0) || s->err)
+			return -1;
+		if (symbol < 16) {
+			length[index++] = symbol;
+			continue;
 		}
+		if (symbol == 16) {
+			if (index == 0)
+				return -1;
+			value = length[index - 1];
+			repeat = 3 + inflate_bits(s, 2);
+		} else if (symbol == 17)
+			repeat = 3 + inflate_bits(s, 3);
+		else
+			repeat = 11 + inflate_bits(s, 7);
+		if (index + repeat > nlen + ndist)
+			return -1;
+		while (repeat--)
+			length[index++] = value;
 	}
-	if(check_fw_signature()<0)
-	{
-		switch_to_ptpmode();
-		request_exit("Firmware Signatrue FAIL.\n");
-	}
+	if (length[256] == 0)
+		return -1;
+
+	/* Incomplete codes are only allowed for a single length */
+	err = inflate_build(&lencode, length, nlen);
+	if ((err < 0) || ((err > 0) && (nlen - lencode.count[0] != 1)))
+		return -1;
+	err = inflate_build(&distcode, length + nlen, ndist);
+	if ((err < 0) || ((err > 0) && (ndist - distcode.count[0] != 1)))
+		return -1;
+	return inflate_codes(s, &lencode, &distcode);
 }
-static void elan_prepare_for_update(void)
+
+static int inflate_stream(struct inflate_state *s)
 {
-	fw_module_id = elan_get_fw_module_id();
-	module_id = elan_get_module_id();
-	
-	if((skip_rule==3)||(skip_rule!=4)) {
-		if(fw_module_id!=module_id) {
-			switch_to_ptpmode();
-			request_exit("The module id not match. (%x/%x)\n", fw_module_id, module_id);
-		}
-	}
-	
-	fw_iap_version = elan_get_fw_iap_ver();
-	
-	if((skip_rule==2)||(skip_rule!=4)) {
-		if(fw_iap_version!=iap_version) {
-			if(((module_id==0x133)&&(iap_version==0x3)) ||
-				((module_id==0x130)&&(iap_version==0x3)) )
-				printf("Skip match iap version.\n");
-			else {
-				switch_to_ptpmode();
-				request_exit("The iap version not match. (%x/%x)\n", fw_iap_version, iap_version);
-			}
+	int last, ret;
+
+	do {
+		last = inflate_bits(s, 1);
+		switch (inflate_bits(s, 2)) {
+		case 0:
+			ret = inflate_stored(s);
+			break;
+		case 1:
+			ret = inflate_fixed(s);
+			break;
+		case 2:
+			ret = inflate_dynamic(s);
+			break;
+		default:
+			ret = -1;
 		}
-	}
-	
-	int ret = elan_set_password();
-	if(ret < 0)
-	{
-		switch_to_ptpmode();
-		request_exit("Unable to set Password FAIL.\n");
-	}
-	
-	if((ic_type==0x13)||(ic_type==0x12)) {
-		if(elan_get_flim_type_enable()==1) {						
-			if(iap_version<=2) {
-				switch_to_ptpmode();
-				request_exit("Unable to support this iap version.\n");
-			}
-			else if(iap_version>=3) {
-				elan_prepare_flimforce_area();
-			}
-				
+		if (ret || s->err)
+			return -1;
+	} while (!last);
+	return 0;
+}
+
+/* Continues crc over data, start with 0 like zlib's crc32() */
+static uint32_t elan_crc32(uint32_t crc, const uint8_t *data, size_t len)
+{
+	static uint32_t table[256];
+
+	crc ^= 0xFFFFFFFF;
+
+	if (!table[1]) {
+		for (uint32_t i = 0; i < 256; i++) {
+			uint32_t c = i;
+			for (int k = 0; k < 8; k++)
+				c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+			table[i] = c;
 		}
 	}
-	
-	int ctrl = elan_get_iap_ctrl();
-	if (ctrl < 0) {
-		switch_to_ptpmode();
-		request_exit("In IAP mode, ReadIAPControl FAIL.\n");
-		
-    	}
+	while (len--)
+		crc = table[(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+	return crc ^ 0xFFFFFFFF;
+}
 
-    	if (((ctrl & 0xFFFF) != ETP_FW_IAP_LAST_FIT)) {
-        	printf("In IAP mode, reset IC.\n");
-        	elan_reset_tp();
-	        usleep(30 * 1000);
-    	}
-	
-	elan_get_iap_fw_page_size();
-	if((ic_type & 0xFF) == 0x0A)
-        	elan_write_cmd(ETP_I2C_IAP_CMD, ETP_I2C_IAP_0A_PASSWORD);
-    	else
-       	 	elan_write_cmd(ETP_I2C_IAP_CMD, ETP_I2C_IAP_PASSWORD);
-	
-	usleep(100 * 1000);
+static uint32_t le_bytes_to_u32(const uint8_t *buf)
+{
+	return buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t)buf[3] << 24);
+}
 
-	ctrl = elan_get_iap_ctrl();
+static int elan_is_gzip(const uint8_t *head, size_t len)
+{
+	return (len >= 2) && (head[0] == GZIP_ID1) && (head[1] == GZIP_ID2);
+}
 
-	if (ctrl < 0) {
-		elan_reset_tp();
-		switch_to_ptpmode();
-		request_exit("In IAP mode, ReadIAPControl FAIL.\n");
+/* Inflates the gzip member in [in, in+len) into out, returns the size or -1 */
+static int elan_gunzip(const uint8_t *in, size_t len, uint8_t *out, size_t out_len)
+{
+	struct inflate_state s;
+	size_t pos = 10;
+	uint8_t flags;
+
+	if ((len < 18) || !elan_is_gzip(in, len) || (in[2] != GZIP_CM_DEFLATE)) {
+		inflate_error = "not a deflate gzip member";
+		return -1;
+	}
+	flags = in[3];
+	if (flags & GZIP_FEXTRA)
+		pos += 2 + (in[pos] | (in[pos + 1] << 8));
+	if (flags & GZIP_FNAME)
+		while ((pos < len) && in[pos++])
+			;
+	if (flags & GZIP_FCOMMENT)
+		while ((pos < len) && in[pos++])
+			;
+	if (flags & GZIP_FHCRC)
+		pos += 2;
+	if (pos + 8 > len) {
+		inflate_error = "truncated header";
+		return -1;
 	}
 
-	if ((ctrl & ETP_FW_IAP_CHECK_PW) == 0){
-		elan_reset_tp();
-		switch_to_ptpmode();
-		request_exit("Got an unexpected IAP password\n");
+	memset(&s, 0, sizeof(s));
+	s.in = in + pos;
+	s.in_len = len - pos - 8;
+	s.out = out;
+	s.out_len = out_len;
+	if (inflate_stream(&s)) {
+		inflate_error = "corrupt or oversized deflate data";
+		return -1;
+	}
+	pos += s.in_pos;
+	if ((pos + 8 > len) || (le_bytes_to_u32(in + pos + 4) != s.out_pos)) {
+		inflate_error = "length does not match the trailer";
+		return -1;
+	}
+	if (le_bytes_to_u32(in + pos) != elan_crc32(0, out, s.out_pos)) {
+		inflate_error = "CRC32 mismatch";
+		return -1;
 	}
+	return s.out_pos;
 }
 
+/*
+ * Image loading.  The binary is mapped read-only over a zeroed
+ * reservation, so reads that run a page past the end of the file see
+ * zeros as they would in a cleared buffer.  Only the pages the flimforce
+ * fill touches are made writable and become private copies.  A gzip
+ * image is inflated into the same kind of reservation instead.
+ */
+#define ETP_IMAGE_SLACK			ETP_MAX_PAGE_SIZE
+
+static size_t fw_map_size;
 
-static int i2c_write_fw_block(uint8_t *raw_data, uint16_t checksum)
+static int elan_try_inflate_image(int fd, size_t size)
 {
-    	unsigned char page_store[fw_section_size + 4];
-    	int rv;
-    	page_store[0] = ETP_I2C_IAP_REG_L;
-    	page_store[1] = ETP_I2C_IAP_REG_H;
-    	memcpy(page_store + 2, raw_data, fw_section_size);
-    	page_store[fw_section_size + 2 + 0] = (checksum >> 0) & 0xff;
-    	page_store[fw_section_size + 2 + 1] = (checksum >> 8) & 0xff;
-	
-	rv = i2c_send_cmd(
-			page_store, sizeof(page_store), 0, 0);
-	if (rv)
-		return rv;
+	long page = sysconf(_SC_PAGESIZE);
+	uint8_t *in = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	uint32_t isize;
+	void *base;
 
-	if((fw_section_size == fw_page_size) || (fw_section_cnt == fw_no_of_sections))
-	{
-		if(fw_page_size == 512)
-			usleep(50 *1000);
-	    	else
-			usleep(35 * 1000);
-		
-		elan_read_cmd(ETP_I2C_IAP_CTRL_CMD);
-		rv = le_bytes_to_int(rx_buf);
-		fw_section_cnt = 0;
-		if (rv & (ETP_FW_IAP_PAGE_ERR | ETP_FW_IAP_INTF_ERR)) {
-			printf("IAP reports failed write : %x\n", rv);
-			fw_section_cnt++;
-			return rv;
-		}
+	close(fd);
+	if (in == MAP_FAILED)
+		return -3;
+	if (size < 18) {
+		inflate_error = "truncated";
+		munmap(in, size);
+		return -4;
 	}
-	fw_section_cnt++;
+	isize = le_bytes_to_u32(in + size - 4);
+	if ((isize == 0) || (isize > MAX_FW_SIZE)) {
+		fw_image_size = (isize > INT_MAX) ? INT_MAX : (int)isize;
+		munmap(in, size);
+		return -2;
+	}
+
+	fw_image_size = isize;
+	fw_map_size = (fw_image_size + ETP_IMAGE_SLACK + page - 1) & ~(page - 1);
+	base = mmap(NULL, fw_map_size, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED) {
+		munmap(in, size);
+		return -3;
+	}
+	int ret = elan_gunzip(in, size, base, fw_image_size);
+	munmap(in, size);
+	if (ret != fw_image_size) {
+		munmap(base, fw_map_size);
+		return -4;
+	}
+	mprotect(base, fw_map_size, PROT_READ);
+	fw_data = base;
 	return 0;
 }
 
-static int elan_enable_long_transmmison_mode()
+/*
+ * Returns 0, -1 if the file cannot be opened, -2 for a bad size, -3 if
+ * mmap fails, -4 for a damaged gzip image (inflate_error says why)
+ */
+static int elan_try_map_image(const char *path)
 {
-    if(elan_write_cmd(0x0322, 0x4607)) {
-	usleep(20 * 1000);
-	return elan_write_cmd(0x0322, 0x4607);	
-    }
-    return 0;
+	long page = sysconf(_SC_PAGESIZE);
+	struct stat st;
+	uint8_t head[2];
+	int fd = open(path, O_RDONLY);
+
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) < 0)
+		st.st_size = 0;
+	if ((st.st_size <= 0) || (st.st_size > MAX_FW_SIZE)) {
+		fw_image_size = (st.st_size > INT_MAX) ? INT_MAX : st.st_size;
+		close(fd);
+		return -2;
+	}
+	if ((pread(fd, head, sizeof(head), 0) == sizeof(head)) &&
+	    elan_is_gzip(head, sizeof(head)))
+		return elan_try_inflate_image(fd, st.st_size);
+
+	fw_image_size = st.st_size;
+	fw_map_size = (fw_image_size + ETP_IMAGE_SLACK + page - 1) & ~(page - 1);
+	void *base = mmap(NULL, fw_map_size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if ((base == MAP_FAILED) ||
+	    (mmap(base, fw_image_size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)) {
+		if (base != MAP_FAILED)
+			munmap(base, fw_map_size);
+		close(fd);
+		return -3;
+	}
+	close(fd);
+	fw_data = base;
+	return 0;
 }
-static int elan_enable_eeprom_iap_mode()
+
+static void elan_map_image(const char *path)
 {
-    if(elan_write_cmd(0x0321, 0x0607)) {
-	usleep(20 * 1000);
-	return elan_write_cmd(0x0321, 0x0607);	
-    }
-    return 0;
+	switch (elan_try_map_image(path)) {
+	case -1:
+		request_exit("Cannot find binary: %s\n", path);
+	case -2:
+		request_exit("Binary %s is %d bytes, at most %d are supported\n",
+			path, fw_image_size, MAX_FW_SIZE);
+	case -3:
+		request_exit("Cannot map binary: %s (%s)\n", path, strerror(errno));
+	case -4:
+		request_exit("Binary %s is a damaged gzip image: %s\n", path, inflate_error);
+	}
 }
-static int elan_disable_long_transmmison_mode()
+
+static void elan_unmap_image(void)
 {
-    if(elan_write_cmd(0x0322, 0x0000)) {
-	usleep(20 * 1000);
-	return elan_write_cmd(0x0322, 0x0000);	
-    }
-    return 0;
+	if (fw_data)
+		munmap(fw_data, fw_map_size);
+	fw_data = NULL;
+	fw_image_size = 0;
 }
-static int elan_disable_eeprom_iap_mode()
+
+/* Make [off, off+len) of the image writable, copying just those pages */
+static int elan_image_make_writable(int off, int len)
 {
-    if(elan_write_cmd(0x0321, 0x0606)) {
-	usleep(20 * 1000);
-	return elan_write_cmd(0x0321, 0x0606);	
-    }
-    return 0;
+	long page = sysconf(_SC_PAGESIZE);
+	uintptr_t start = (uintptr_t)(fw_data + off) & ~(page - 1);
+	uintptr_t end = (uintptr_t)(fw_data + off + len);
+
+	if ((off < 0) || (len < 0) || (off + len > fw_image_size))
+		return -1;
+	return mprotect((void *)start, end - start, PROT_READ | PROT_WRITE);
 }
-static int elan_set_eeprom_datatype()
+
+/* Little-endian word of the image, -1 if it lies outside the file */
+static int elan_image_word(int off)
 {
-    if(elan_write_cmd(0x0321, 0x0702)) {
-	usleep(20 * 1000);
+	if ((off < 0) || (off + 2 > fw_image_size))
+		return -1;
+	return le_bytes_to_int(fw_data + off);
+}
+
+static int elan_get_iap_addr(void)
+{
+	int addr = elan_image_word(ETP_IAP_START_ADDR * 2);
+	return (addr < 0) ? -1 : addr * 2;
+}
+static int elan_get_fw_module_id(void)
+{
+	int start_addr = elan_get_iap_addr();
+	int unique_addr = elan_image_word(start_addr);
+	if ((start_addr < 0) || (unique_addr < 0))
+		return -1;
+	return elan_image_word(unique_addr * 2);
+}
+static int elan_get_fw_iap_ver(void)
+{
+	return elan_image_word(ETP_IAP_VER_ADDR * 2) ;
+}
+static int elan_get_fw_flimforce_addr()
+{
+	int addr;
+
+	if(iap_version<=4) {
+		int start_addr = elan_get_iap_addr();
+		addr = (start_addr < 0) ? -1 : elan_image_word(start_addr + 6);
+	}
+	else
+		addr = elan_image_word(ETP_IAP_FLIMFORCE_ADDR_V5 * 2);
+	return (addr < 0) ? -1 : addr * 2;
+}
+static int elan_get_flimforce_addr()
+{
+    if(iap_version==0x3)
+    {
+    	if((module_id==0x130)||(module_id==0x133))
+    		return 0xFF40 * 2;
+    	else
+    		return -3;
+    }
+    	
+    if((ic_type==0x13)&&(iap_version>=5)) {
+	    elan_read_cmd(ETP_I2C_FLIMFORCE_ADDR_CMD);
+	    return le_bytes_to_int(rx_buf)  * 2;
+    }
+    
+    return -1;
+}
+static void elan_calc_fw_flimforce_checksum()
+{
+    fw_flimforce_area_checksum = 0;
+    if(fw_size_all > fw_flimforce_addr)
+    	fw_flimforce_area_checksum = elan_calc_checksum(fw_data + fw_flimforce_addr,
+    						fw_size_all - fw_flimforce_addr);
+
+}
+static int elan_check_flimforeaddr_legal(int addrw)
+{
+   if(addrw%32==0)
+	return 0;
+   else 
+   	return -1;	
+
+}
+
+#define ETP_I2C_IAP_REG_L		0x01
+#define ETP_I2C_IAP_REG_H		0x06
+
+#define ETP_FW_IAP_PAGE_ERR		(1 << 5)
+#define ETP_FW_IAP_INTF_ERR		(1 << 4)
+
+static int elan_image_signature_ok(int addr)
+{
+	static const uint8_t signature[] = {0xAA, 0x55, 0xCC, 0x33, 0xFF, 0xFF};
+
+	if ((addr < 0) || (addr + (int)sizeof(signature) > fw_image_size))
+		return 0;
+	return !memcmp(fw_data + addr, signature, sizeof(signature));
+}
+
+static int check_fw_signature()
+{
+
+	static const uint8_t signature[] = {0xAA, 0x55, 0xCC, 0x33, 0xFF, 0xFF};
+	if ((fw_signature_address < 0) ||
+	    (fw_signature_address + (int)sizeof(signature) > fw_image_size)) {
+		printf("signature address %x is outside the image\n", fw_signature_address);
+		return -1;
+	}
+	/* Firmware file must match signature data */
+	for(int i=0; i< sizeof(signature); i++)
+	{
+		if(fw_data[fw_signature_address+i]!=signature[i]) {
+			printf("signature mismatch (expected %x, got %x)\n",signature[i], fw_data[fw_signature_address+i]);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+/* Page and section size for this IC and IAP version, reads only */
+static void elan_iap_page_layout(void)
+{
+	fw_page_size = 64; 
+	fw_section_size = 64;
+	fw_no_of_sections = 1;
+	if((ic_type>=0x10)&&(iap_version>=1))
+	{
+		if((iap_version>=2)&&((ic_type==0x14)||(ic_type==0x15)))
+		{
+			fw_page_size = 512;
+			if(iap_version>=3)
+			{
+				fw_section_size = elan_get_iap_type() * 2;
+				fw_no_of_sections = fw_page_size / fw_section_size;
+			}
+			else
+				fw_section_size = 512;
+		}
+		else
+		{
+			fw_page_size = 128; 
+			fw_section_size = 128;
+		}
+	}
+}
+static void elan_try_burst(void);
+static void elan_get_iap_fw_page_size(void)
+{
+	/* Recomputed even when cached, a burst or a reset changes the sections */
+	elan_iap_page_layout();
+    	if(ic_type>=0x10)
+    	{
+        	if(iap_version>=1)
+        	{
+			if(fw_section_size == fw_page_size) {
+				elan_write_cmd(ETP_I2C_IAP_TYPE_CMD, fw_section_size / 2);
+				int iap_type = elan_get_iap_type();
+				if((iap_type & 0xFFFF)!= ((fw_section_size / 2)& 0xFFFF))
+		    		{
+		      
+		        		elan_write_cmd(ETP_I2C_IAP_TYPE_CMD, fw_section_size / 2);
+					iap_type = elan_get_iap_type();
+		        		if((iap_type & 0xFFFF)!= ((fw_section_size / 2)& 0xFFFF))
+		        		{			
+						elan_reset_tp();
+						switch_to_ptpmode();
+						request_exit("Read/Wirte IAP Type Command FAIL!!\n");
+		        		}
+		    		}
+			}
+
+
+        	}
+	}
+
+}
+/*
+ * Identity cache.  Discovery and the identity reads give the same answers
+ * until the machine reboots or the part is reset or updated, so with
+ * --cache they are kept in a small record keyed by the boot ID and the
+ * device node.  A later run opens the node directly and trusts the record
+ * once a module ID read agrees with it.
+ */
+#define CACHE_MAGIC			"ETPCACH1"
+#define BOOT_ID_PATH			"/proc/sys/kernel/random/boot_id"
+
+struct elan_cache {
+	char magic[8];
+	char boot_id[40];
+	char node[64];
+	int32_t interface_type;
+	int32_t bus_type;
+	uint16_t vid;
+	uint16_t pid;
+	uint16_t i2caddr;
+	uint16_t module_id;
+	int32_t is_new_pattern;
+	int32_t iap_version;
+	int32_t ic_type;
+	int32_t page_size;
+	int32_t section_size;
+	int32_t no_of_sections;
+};
+
+/* The node a run asks for, empty when any node with our ids will do */
+static void elan_cache_key(char *node, int len)
+{
+	node[0] = 0;
+	if (sim_enabled)
+		snprintf(node, len, "sim");
+	else if (hidraw_num != INITIAL_VALUE)
+		snprintf(node, len, "%s%s%d", LINUX_DEV_PATH, HID_RAW_NAME, hidraw_num);
+	else if (i2c_num != INITIAL_VALUE)
+		snprintf(node, len, "%s%s%d", LINUX_DEV_PATH, I2C_NAME, i2c_num);
+}
+
+static int elan_cache_load(void)
+{
+	struct elan_cache c;
+	struct hidraw_devinfo info;
+	char boot_id[40], node[64];
+	int fd, len;
+
+	if (!cache_path || replay_data)
+		return -1;
+	fd = open(cache_path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	len = read(fd, &c, sizeof(c));
+	close(fd);
+	if ((len != sizeof(c)) || memcmp(c.magic, CACHE_MAGIC, sizeof(c.magic)))
+		return -1;
+	c.boot_id[sizeof(c.boot_id) - 1] = 0;
+	c.node[sizeof(c.node) - 1] = 0;
+	if (sysfs_read_line(BOOT_ID_PATH, NULL, boot_id, sizeof(boot_id)) ||
+	    strcmp(boot_id, c.boot_id) || (c.vid != vid) || (c.pid != pid))
+		return -1;
+	elan_cache_key(node, sizeof(node));
+	if (node[0] ? strcmp(node, c.node) : !strcmp(c.node, "sim"))
+		return -1;
+
+	fd = -1;
+	if (c.interface_type == I2C_INTERFACE) {
+		fd = open(c.node, O_RDWR);
+		if ((fd < 0) || ((ioctl(fd, I2C_SLAVE, c.i2caddr) < 0) &&
+				 (ioctl(fd, I2C_SLAVE_FORCE, c.i2caddr) < 0)))
+			goto stale;
+	} else if (!sim_enabled) {
+		/* hidraw numbers are reused on hotplug, check the ids first */
+		fd = open(c.node, O_RDWR|O_NONBLOCK);
+		if ((fd < 0) || (ioctl(fd, HIDIOCGRAWINFO, &info) < 0) ||
+		    (info.vendor != c.vid) || (info.product != c.pid))
+			goto stale;
+	}
+	dev_fd = fd;
+	elan_set_interface(c.interface_type);
+	if (elan_get_module_id() != c.module_id)
+		goto stale;
+
+	bus_type = c.bus_type;
+	i2caddr = c.i2caddr;
+	module_id = c.module_id;
+	is_new_pattern = c.is_new_pattern;
+	iap_version = c.iap_version;
+	ic_type = c.ic_type;
+	fw_page_size = c.page_size;
+	fw_section_size = c.section_size;
+	fw_no_of_sections = c.no_of_sections;
+	identity_cached = 1;
+	return 0;
+
+stale:
+	if (fd >= 0)
+		close(fd);
+	dev_fd = -1;
+	return -1;
+}
+
+static void elan_cache_save(void)
+{
+	struct elan_cache c;
+	char link[64], tmp[PATH_MAX + 8];
+	int fd;
+
+	if (!cache_path || replay_data)
+		return;
+	is_new_pattern = elan_get_patten();
+	iap_version = elan_get_version(1);
+	module_id = elan_get_module_id();
+	ic_type = elan_get_ic_type();
+	/* A part in IAP mode or of an unknown type is not worth remembering */
+	if ((elan_ic_type_page_count(ic_type) < 0) || (module_id == 0xFFFF))
+		return;
+	elan_iap_page_layout();
+	identity_cached = 1;
+
+	memset(&c, 0, sizeof(c));
+	memcpy(c.magic, CACHE_MAGIC, sizeof(c.magic));
+	if (sysfs_read_line(BOOT_ID_PATH, NULL, c.boot_id, sizeof(c.boot_id)))
+		return;
+	if (sim_enabled) {
+		snprintf(c.node, sizeof(c.node), "sim");
+	} else {
+		snprintf(link, sizeof(link), "/proc/self/fd/%d", dev_fd);
+		if (readlink(link, c.node, sizeof(c.node) - 1) <= 0)
+			return;
+	}
+	c.interface_type = interface_type;
+	c.bus_type = bus_type;
+	c.vid = vid;
+	c.pid = pid;
+	c.i2caddr = i2caddr;
+	c.module_id = module_id;
+	c.is_new_pattern = is_new_pattern;
+	c.iap_version = iap_version;
+	c.ic_type = ic_type;
+	c.page_size = fw_page_size;
+	c.section_size = fw_section_size;
+	c.no_of_sections = fw_no_of_sections;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", cache_path);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return;
+	if (write(fd, &c, sizeof(c)) != sizeof(c)) {
+		close(fd);
+		unlink(tmp);
+		return;
+	}
+	close(fd);
+	if (rename(tmp, cache_path) < 0)
+		unlink(tmp);
+}
+
+static void elan_cache_invalidate(void)
+{
+	if (cache_path)
+		unlink(cache_path);
+}
+static int elan_write_password(int pw)
+{
+    if(elan_write_cmd(ETP_I2C_PASSWORD_CMD, pw)) {
+	SLEEP(20 * 1000);
+	return elan_write_cmd(ETP_I2C_PASSWORD_CMD, pw);	
+    }
+    return 0;
+}
+static int elan_set_password()
+{ 
+    int pw=0;
+    if(iap_version<0) {
+    	is_new_pattern = elan_get_patten();
+	iap_version = elan_get_version(1);
+    }
+    
+    if(ic_type<=0) 
+    	ic_type = elan_get_ic_type();
+    	
+    if((iap_version>=5)&&(ic_type==0x13))
+    	pw = ETP_I2C_IC13_IAPV5_PW & 0xFFFF;
+    else
+    	return 0;
+   
+    for(int i=0; i<3; i++) {
+    	int rv=-1;
+    	rv = elan_write_password(pw);
+    	if(rv < 0)
+    		return -1;
+			
+    	rv=-1;
+    	elan_read_cmd(ETP_I2C_PASSWORD_CMD);
+    	rv = le_bytes_to_int(rx_buf);
+		    
+    	if(rv==pw)
+    		return 0;
+    }
+    return -2;
+
+}
+static int filling_flimfore_area()
+{
+	static const uint8_t fillature[] = {0x77, 0x33, 0x44, 0xaa};
+	static const uint8_t signature[] = {0xAA, 0x55, 0xCC, 0x33, 0xFF, 0xFF};
+
+	if(fw_size_all<=0)
+		return -1;
+
+	if(fw_flimforce_addr<=0)
+		return -2;
+
+	if(flimforce_addr<=0)
+		return -3;
+
+	int size = flimforce_addr - fw_flimforce_addr;
+	if(size%64!=0)
+		return -4;
+	if (elan_image_make_writable(fw_flimforce_addr, size) < 0)
+		return -5;
+	
+	for(int i=fw_flimforce_addr; i< flimforce_addr; i+=64)
+	{
+		for(int j=i; j< i+64; j++)
+			fw_data[j] = 0xFF;
+			
+		for(int l=0; l< sizeof(fillature); l++)
+			fw_data[l+i] = fillature[l];
+		
+		fw_data[i+4] = (flimforce_addr/2) & 0xFF;
+		fw_data[i+5] = ((flimforce_addr/2) >> 8) & 0xFF;
+		
+		for(int k=0; k< sizeof(signature); k++)
+			fw_data[i+64-6+k] = signature[k];
+			
+		uint16_t block_checksum = elan_calc_checksum(fw_data + i, 64) - 0xFFFF;
+		uint16_t filling_value = 0x10000 - (block_checksum & 0xFFFF);
+		fw_data[i+6] = filling_value & 0xFF;
+		fw_data[i+7] = (filling_value >> 8) & 0xFF;
+	}
+	return size;
+}
+static void elan_layout_flimforce_area(void);
+static void elan_prepare_flimforce_area(void)
+{
+	fw_flimforce_addr = elan_get_fw_flimforce_addr();
+	flimforce_addr = elan_get_flimforce_addr();
+	
+	if(flimforce_addr==-3)
+		flimforce_addr = fw_flimforce_addr;
+
+	printf("ForceTBLaddr: %4x, Frombinaddr: %4x\n",
+			flimforce_addr/2, fw_flimforce_addr/2);
+				
+	if(flimforce_addr < fw_flimforce_addr)
+	{
+		switch_to_ptpmode();
+		request_exit("The Flimforce area can't filling.\n");
+	}
+	int ret = elan_check_flimforeaddr_legal(flimforce_addr/2);
+	if (ret<0)
+	{
+		switch_to_ptpmode();
+		request_exit("The Flimforce address is illegal.\n");
+	}
+	ret = elan_check_flimforeaddr_legal(fw_flimforce_addr/2);
+	if (ret<0)
+	{
+		switch_to_ptpmode();
+		request_exit("The FW Flimforce address is illegal.\n");
+	}
+	
+	elan_layout_flimforce_area();
+}
+
+/* Moves the end of the image to the device's flimforce table and fills the gap */
+static void elan_layout_flimforce_area(void)
+{
+	int new_fw_size = flimforce_addr;
+	fw_size_all = fw_size;
+	fw_size = new_fw_size - 1;
+	fw_signature_address = new_fw_size - FW_SIGNATURE_SIZE;
+
+	elan_calc_fw_flimforce_checksum();
+	if(flimforce_addr > fw_flimforce_addr)
+	{
+		if(filling_flimfore_area()<0)
+		{
+			switch_to_ptpmode();
+			request_exit("The Flimforce area filling error.\n");
+		}
+	}
+	if(check_fw_signature()<0)
+	{
+		switch_to_ptpmode();
+		request_exit("Firmware Signatrue FAIL.\n");
+	}
+}
+static void elan_enter_iap(void);
+static void elan_build_flash_plan(void);
+static void elan_build_eeprom_plan(int page_size);
+static void elan_prepare_for_update(void)
+{
+	fw_module_id = elan_get_fw_module_id();
+	if (!identity_cached)
+		module_id = elan_get_module_id();
+	
+	if((skip_rule==3)||(skip_rule!=4)) {
+		if(fw_module_id!=module_id) {
+			switch_to_ptpmode();
+			request_exit("The module id not match. (%x/%x)\n", fw_module_id, module_id);
+		}
+	}
+	
+	fw_iap_version = elan_get_fw_iap_ver();
+	
+	if((skip_rule==2)||(skip_rule!=4)) {
+		if(fw_iap_version!=iap_version) {
+			if(((module_id==0x133)&&(iap_version==0x3)) ||
+				((module_id==0x130)&&(iap_version==0x3)) )
+				printf("Skip match iap version.\n");
+			else {
+				switch_to_ptpmode();
+				request_exit("The iap version not match. (%x/%x)\n", fw_iap_version, iap_version);
+			}
+		}
+	}
+	
+	int ret = elan_set_password();
+	if(ret < 0)
+	{
+		switch_to_ptpmode();
+		request_exit("Unable to set Password FAIL.\n");
+	}
+	
+	if((ic_type==0x13)||(ic_type==0x12)) {
+		if(elan_get_flim_type_enable()==1) {						
+			if(iap_version<=2) {
+				switch_to_ptpmode();
+				request_exit("Unable to support this iap version.\n");
+			}
+			else if(iap_version>=3) {
+				elan_prepare_flimforce_area();
+			}
+				
+		}
+	}
+
+	elan_enter_iap();
+}
+
+static void elan_enter_iap(void)
+{
+	int ctrl;
+
+	/* The part leaves main mode here, whatever it was is no longer known */
+	elan_cache_invalidate();
+	ctrl = elan_get_iap_ctrl();
+	if (ctrl < 0) {
+		switch_to_ptpmode();
+		request_exit("In IAP mode, ReadIAPControl FAIL.\n");
+		
+    	}
+
+    	if (((ctrl & 0xFFFF) != ETP_FW_IAP_LAST_FIT)) {
+        	printf("In IAP mode, reset IC.\n");
+        	elan_reset_tp();
+	        elan_wait_ready(READY_RESET, 30 * 1000);
+    	}
+	
+	elan_get_iap_fw_page_size();
+	/* Main flash only, the EEPROM path sets up long transmission itself */
+	if (burst_mode && (fw_section_size < fw_page_size))
+		elan_try_burst();
+	elan_build_flash_plan();
+	if((ic_type & 0xFF) == 0x0A)
+        	elan_write_cmd(ETP_I2C_IAP_CMD, ETP_I2C_IAP_0A_PASSWORD);
+    	else
+       	 	elan_write_cmd(ETP_I2C_IAP_CMD, ETP_I2C_IAP_PASSWORD);
+	
+	elan_wait_ready(READY_PASSWORD, 100 * 1000);
+
+	ctrl = elan_get_iap_ctrl();
+
+	if (ctrl < 0) {
+		elan_reset_tp();
+		switch_to_ptpmode();
+		request_exit("In IAP mode, ReadIAPControl FAIL.\n");
+	}
+
+	if ((ctrl & ETP_FW_IAP_CHECK_PW) == 0){
+		elan_reset_tp();
+		switch_to_ptpmode();
+		request_exit("Got an unexpected IAP password\n");
+	}
+}
+
+/*
+ * IAP page completion.
+ *
+ * Every page is followed by a fixed delay long enough for the slowest
+ * part.  The IAP control register has no page done bit: PAGE_ERR and
+ * INTF_ERR only flag a rejected frame, and while the page is programmed
+ * the part may still answer with the value it had before the write.  A
+ * clean read is therefore no proof the page is in, and poll mode keeps
+ * the fixed delay as its floor.  After it, the register is polled with a
+ * doubling step for as long as the part does not answer or reports an
+ * error, up to ETP_POLL_DEADLINE_MUL times the fixed delay, instead of
+ * being read once.  The last value read is handed back, so a stuck page
+ * still fails the same way it used to.
+ */
+#define ETP_POLL_INITIAL_US		2000
+#define ETP_POLL_MAX_STEP_US		8000
+#define ETP_POLL_DEADLINE_MUL		3
+#define ETP_POLL_HIST_BUCKETS		10
+
+static unsigned int page_wait_hist[ETP_POLL_HIST_BUCKETS];
+static unsigned int page_wait_count;
+static uint64_t page_wait_total_us;
+static uint64_t page_wait_min_us = UINT64_MAX;
+static uint64_t page_wait_max_us;
+
+static void elan_record_page_wait(uint64_t us)
+{
+	int bucket = 0;
+
+	/* Bucket 0 is < 1 ms, bucket n is [2^(n-1), 2^n) ms */
+	for (uint64_t ms = us / 1000; ms && bucket < ETP_POLL_HIST_BUCKETS - 1; ms >>= 1)
+		bucket++;
+	page_wait_hist[bucket]++;
+	page_wait_count++;
+	page_wait_total_us += us;
+	if (us < page_wait_min_us)
+		page_wait_min_us = us;
+	if (us > page_wait_max_us)
+		page_wait_max_us = us;
+}
+
+static void elan_print_page_wait(void)
+{
+	if (!page_wait_count)
+		return;
+
+	printf("Page wait: %u pages, min %.1f ms, avg %.1f ms, max %.1f ms\n",
+		page_wait_count, page_wait_min_us / 1000.0,
+		page_wait_total_us / 1000.0 / page_wait_count,
+		page_wait_max_us / 1000.0);
+	for (int i = 0; i < ETP_POLL_HIST_BUCKETS; i++) {
+		if (!page_wait_hist[i])
+			continue;
+		if (i == 0)
+			printf("  [   0,   1) ms: %u\n", page_wait_hist[i]);
+		else if (i == ETP_POLL_HIST_BUCKETS - 1)
+			printf("  [%4d,    ) ms: %u\n", 1 << (i - 1), page_wait_hist[i]);
+		else
+			printf("  [%4d,%4d) ms: %u\n", 1 << (i - 1), 1 << i,
+				page_wait_hist[i]);
+	}
+}
+
+static int elan_iap_page_ready(int ctrl)
+{
+	if ((ctrl == 0xFFFF) || (ctrl == ETP_I2C_IAP_CTRL_CMD))
+		return 0;
+	return (ctrl & (ETP_FW_IAP_PAGE_ERR | ETP_FW_IAP_INTF_ERR)) == 0;
+}
+
+static int elan_wait_fw_page(void)
+{
+	int fixed_us = (fw_page_size == 512) ? 50 * 1000 : 35 * 1000;
+	uint64_t start, deadline, now;
+	int step = ETP_POLL_INITIAL_US;
+	int ctrl;
+
+	if (!poll_mode) {
+		SLEEP(fixed_us);
+		elan_read_cmd(ETP_I2C_IAP_CTRL_CMD);
+		return le_bytes_to_int(rx_buf);
+	}
+
+	start = elan_get_time_us();
+	deadline = start + (uint64_t)fixed_us * ETP_POLL_DEADLINE_MUL;
+	SLEEP(fixed_us);
+	for (;;) {
+		int ret = elan_read_cmd(ETP_I2C_IAP_CTRL_CMD);
+
+		ctrl = le_bytes_to_int(rx_buf);
+		now = elan_get_time_us();
+		if ((ret == 0) && elan_iap_page_ready(ctrl))
+			break;
+		if (now >= deadline)
+			break;
+		if (now + step > deadline)
+			step = deadline - now;
+		SLEEP(step);
+		step *= 2;
+		if (step > ETP_POLL_MAX_STEP_US)
+			step = ETP_POLL_MAX_STEP_US;
+	}
+	elan_record_page_wait(now - start);
+	return ctrl;
+}
+
+
+static int i2c_fw_frame(uint8_t *page_store, const uint8_t *raw_data, uint16_t checksum)
+{
+    	page_store[0] = ETP_I2C_IAP_REG_L;
+    	page_store[1] = ETP_I2C_IAP_REG_H;
+    	memcpy(page_store + 2, raw_data, fw_section_size);
+    	page_store[fw_section_size + 2 + 0] = (checksum >> 0) & 0xff;
+    	page_store[fw_section_size + 2 + 1] = (checksum >> 8) & 0xff;
+	
+	return fw_section_size + 4;
+}
+static int i2c_send_frame(uint8_t *frame, int len)
+{
+	return i2c_send_cmd(frame, len, NULL, 0);
+}
+
+static int elan_enable_long_transmmison_mode()
+{
+    if(elan_write_cmd(0x0322, 0x4607)) {
+	SLEEP(20 * 1000);
+	return elan_write_cmd(0x0322, 0x4607);	
+    }
+    return 0;
+}
+static int elan_enable_eeprom_iap_mode()
+{
+    if(elan_write_cmd(0x0321, 0x0607)) {
+	SLEEP(20 * 1000);
+	return elan_write_cmd(0x0321, 0x0607);	
+    }
+    return 0;
+}
+static int elan_disable_long_transmmison_mode()
+{
+    if(elan_write_cmd(0x0322, 0x0000)) {
+	SLEEP(20 * 1000);
+	return elan_write_cmd(0x0322, 0x0000);	
+    }
+    return 0;
+}
+static int elan_disable_eeprom_iap_mode()
+{
+    if(elan_write_cmd(0x0321, 0x0606)) {
+	SLEEP(20 * 1000);
+	return elan_write_cmd(0x0321, 0x0606);	
+    }
+    return 0;
+}
+
+/*
+ * --burst.  Pages of 512 byte parts with IAP version 3 normally go out
+ * as several IAP-type sized sections, one report each.  With the long
+ * transmission mode the EEPROM update uses, the part may take the whole
+ * page in one report; the IAP type read back says whether it does.
+ * Like finish_update_fw() on the EEPROM path, long transmission is
+ * turned off and the IAP type put back once the update is over, and on
+ * any exit in between.
+ */
+static int burst_iap_type = -1;		/* IAP type to restore, -1 when no burst */
+
+static void elan_end_burst(void)
+{
+	int iap_type = burst_iap_type;
+
+	if (iap_type < 0)
+		return;
+	burst_iap_type = -1;
+	if (elan_disable_long_transmmison_mode() < 0)
+		printf("Burst: disable Long Transmmison mode FAIL\n");
+	elan_write_cmd(ETP_I2C_IAP_TYPE_CMD, iap_type);
+}
+
+static void elan_try_burst(void)
+{
+	static int at_exit;
+	int section = fw_section_size;
+	int iap_type = elan_get_iap_type();
+
+	if (elan_enable_long_transmmison_mode() < 0) {
+		printf("Burst: no long transmission, keeping %d byte sections\n", section);
+		return;
+	}
+	elan_write_cmd(ETP_I2C_IAP_TYPE_CMD, fw_page_size / 2);
+	if ((elan_get_iap_type() & 0xFFFF) == fw_page_size / 2) {
+		fw_section_size = fw_page_size;
+		fw_no_of_sections = 1;
+		burst_iap_type = (iap_type < 0) ? section / 2 : (iap_type & 0xFFFF);
+		if (!at_exit++)
+			atexit(elan_end_burst);
+		printf("Burst: %d byte pages in one report (was %d byte sections)\n",
+			fw_page_size, section);
+		return;
+	}
+	elan_write_cmd(ETP_I2C_IAP_TYPE_CMD, section / 2);
+	elan_disable_long_transmmison_mode();
+	printf("Burst: the part keeps %d byte sections\n", section);
+}
+static int elan_set_eeprom_datatype()
+{
+    if(elan_write_cmd(0x0321, 0x0702)) {
+	SLEEP(20 * 1000);
 	return elan_write_cmd(0x0321, 0x0702);	
     }
     return 0;
 }
-static int elan_calc_eeprom_checksum()
+static int elan_calc_eeprom_checksum()
+{
+    if(elan_write_cmd(0x0321, 0x060F)) {
+	SLEEP(20 * 1000);
+	return elan_write_cmd(0x0321, 0x060F);	
+    }
+    return 0;
+}
+
+static int elan_read_eeprom_checksum()
+{
+    if(elan_write_cmd(0x0321, 0x070A)) {
+	SLEEP(20 * 1000);
+	if(elan_write_cmd(0x0321, 0x070A)) {
+		return -1;
+	}	
+    }
+    elan_read_cmd(0x0321);
+    return le_bytes_to_int(rx_buf);
+}
+
+/*
+ * The EEPROM checksum takes the part anywhere from a few ms to well over
+ * 100 ms.  The busy bit (0x20) is polled from ETP_EE_POLL_INITIAL_US on,
+ * doubling up to ETP_EE_POLL_MAX_STEP_US, until --eeprom-timeout.  The
+ * checksum itself can show up a little after the busy bit clears, so it
+ * is read with the same backoff for up to ETP_EE_READ_WINDOW_US, the
+ * three 100 ms tries it always had.
+ */
+#define ETP_EE_POLL_INITIAL_US		2000
+#define ETP_EE_POLL_MAX_STEP_US		(100 * 1000)
+#define ETP_EE_READ_WINDOW_US		(300 * 1000)
+
+static uint64_t eeprom_checksum_us;
+static int eeprom_checksum_polls;
+
+static int elan_read_eeprom_checksum_process()
+{
+    int rv=elan_calc_eeprom_checksum();
+    int step = ETP_EE_POLL_INITIAL_US;
+    uint64_t start = elan_get_time_us();
+    uint64_t deadline = start + (uint64_t)eeprom_timeout_ms * 1000;
+    uint64_t now;
+    if(rv<0)
+    {
+	printf( "Calc eeprom checksum cmd error..  \n");
+        rv=-5;	
+        return rv;
+
+    }
+    eeprom_checksum_polls = 0;
+wait:
+    SLEEP(step);
+    rv = elan_set_eeprom_datatype();
+    if(rv<0)
+    {
+	printf( "set eeprom datatype cmd error..  \n");
+        rv=-6;
+        return rv;
+    }
+
+    elan_read_cmd(0x0321);
+    rv = le_bytes_to_int(rx_buf);
+    eeprom_checksum_polls++;
+    if((rv & 0x20)==0x20)
+    {	
+	now = elan_get_time_us();
+	if(now>=deadline)
+	{
+		printf( "Read eeprom checksum error.. (1) \n");
+		rv=-7;
+		return rv;
+	}
+	step *= 2;
+	if (step > ETP_EE_POLL_MAX_STEP_US)
+		step = ETP_EE_POLL_MAX_STEP_US;
+	if (now + step > deadline)
+		step = deadline - now;
+	goto wait;
+    }
+    eeprom_checksum_us = elan_get_time_us() - start;
+
+    step = ETP_EE_POLL_INITIAL_US;
+    deadline = elan_get_time_us() + ETP_EE_READ_WINDOW_US;
+    for(;;)
+    {
+    	rv=elan_read_eeprom_checksum();
+	now = elan_get_time_us();
+     	if((rv>0) || (now>=deadline))
+		break;
+	if (now + step > deadline)
+		step = deadline - now;
+	SLEEP(step);
+	step *= 2;
+	if (step > ETP_EE_POLL_MAX_STEP_US)
+		step = ETP_EE_POLL_MAX_STEP_US;
+    }
+    if(rv<0)
+    {
+	printf( "Read eeprom checksum error.. (2)  \n");
+	rv=-8;
+        return rv;
+    }
+    return rv;	
+}
+
+static int elan_read_eeprom_version()
+{
+    unsigned short v_s=0;
+    unsigned short v_d=0;
+    unsigned short v_m=0;
+    unsigned short v_y=0;
+    char buf[256] = "\0";
+    
+   if(elan_write_cmd(0x0321, 0x0710)) {
+	SLEEP(20 * 1000);
+	if(elan_write_cmd(0x0321, 0x0710))
+		return -2;
+    }
+    elan_read_cmd(0x0321);
+    v_d = rx_buf[0];
+    v_m = rx_buf[1] & 0xF;
+    v_s = (rx_buf[1] & 0xF0) >> 4;
+
+    if(elan_write_cmd(0x0321, 0x0711)) {
+	SLEEP(20 * 1000);
+	if(elan_write_cmd(0x0321, 0x0711)) 
+		return -3;
+    }
+    elan_read_cmd(0x0321);
+    v_y = rx_buf[0];
+    eeprom_iap_version = rx_buf[1];
+
+    if((v_y==0xFF)||(v_m==0xFF)||(v_d==0xFF)||(v_s==0xFF))
+	return 0;
+    sprintf(buf, "%02d%02d%02d%02d", v_y, v_m, v_d, v_s);
+    return atoi(buf);
+}
+
+static int elan_restart_driver_ic()
+{
+    if(elan_write_cmd(0x0321, 0x0601)) {
+	SLEEP(20 * 1000);
+	return elan_write_cmd(0x0321, 0x0601);	
+    }
+    return 0;
+}
+
+static int elan_write_info_eeprom_checksum(unsigned short checksum)
+{
+	
+    if(elan_write_cmd(0x0322, 0x4600)) {
+	SLEEP(20 * 1000);
+	if(elan_write_cmd(0x0322, 0x4600)) {
+		return -1;
+	}
+    }
+    elan_read_cmd(0x0322);
+    int ret = le_bytes_to_int(rx_buf);
+    if((ret & 0xFFFF)!=0x4600)
+    	return -2;
+
+    if(elan_set_password() < 0) {
+	if(elan_set_password() < 0)
+		return -6;
+    }
+    if(elan_write_cmd(0x0311, 0x1EA5)) {
+	SLEEP(20 * 1000);
+	if(elan_write_cmd(0x0311, 0x1EA5)) 
+		return -3;
+    }
+    if(elan_write_cmd(0x048b, checksum)) {
+	SLEEP(20 * 1000);
+	if(elan_write_cmd(0x048b, checksum)) 
+		return -4;
+
+    }
+    if(elan_write_cmd(0x0322, 0x0000)) {
+	SLEEP(20 * 1000);
+	if(elan_write_cmd(0x0322, 0x0000)) 
+		return -5;
+
+    }
+    elan_read_cmd(0x048b);
+    ret = le_bytes_to_int(rx_buf);
+    if((ret & 0xFFFF)!=checksum)
+    	 return -6;
+  
+    return 1;
+
+}
+
+static int elan_get_eeprom_iap_ctrl(void)
+{
+    elan_read_cmd(0x0321);
+    int ret = le_bytes_to_int(rx_buf);
+    if((ret & 0x800)!=0x800)
+    {
+        printf("Error bit11 fail %x\n", ret);
+        return -1;
+    }
+    if((ret & 0x1000)==0x1000)
+    {
+        printf("Error bit12 fail Resend %x\n", ret);      
+        return 0;
+    }
+    return 1;
+
+}
+
+static int elan_eeprom_prepare_for_update()
+{
+
+    int ret = elan_get_eeprom_enable();
+    if(ret <= 0)
+    {
+	printf("EEPROM is not Enable.(%x) !!\n", ret);
+        return -2;
+    }
+  
+    ret = elan_read_eeprom_version();
+    if(ret < -1)
+    {
+	printf("Read EEPROM Version FAIL  (%d) !!\n", ret);
+        return -1;
+    }
+    if((eeprom_driver_ic!=2)||(eeprom_iap_version!=1))
+    {
+	printf("Can't support this EEPROM IAP (%x,%x) !!\n", eeprom_driver_ic, eeprom_iap_version);
+        return -3;
+    }
+
+    elan_get_iap_fw_page_size();
+    if (!eeprom_burst)
+	elan_build_eeprom_plan(ETP_EEPROM_PAGE_SIZE);
+
+    for(int i=0; i<10; i++) {
+	    ret = elan_enable_long_transmmison_mode();
+	    if(ret < 0)
+	    {
+		printf("Long Transmmison mode FAIL  (%x) !!\n", ret);
+		return -4;
+	    }
+	    ret = elan_enable_eeprom_iap_mode();
+	    if(ret < 0)
+	    {
+		printf("Enable EEPROM IAP mode FAIL  (%x) !!\n", ret);
+		return -5;
+	    }
+
+	    elan_read_cmd(0x0321);
+	    ret = le_bytes_to_int(rx_buf);
+	    if((ret & 0x800)!=0x800)
+	    {
+                ret=0;
+		i=10;
+	    }
+
+    }
+    if(ret < 0)
+    {
+	printf("Can't Enter EEPROM IAP mode (%x) !!\n", ret);
+	return -6;
+    }
+    return 1;
+
+
+}
+
+static int i2c_eeprom_frame(uint8_t *page_store, int index, const uint8_t *raw_data, unsigned short checksum, int eeprom_page_size)
+{
+    int frame_size = fw_page_size*2 + 11;
+    int report_size = fw_page_size*2 + 5;
+
+    /* With a negotiated payload the frame ends after the checksum */
+    if (eeprom_payload) {
+	frame_size = eeprom_page_size + 15;
+	report_size = eeprom_page_size + 9;
+    }
+    memset(page_store, 0 , frame_size);
+    
+    page_store[0]  = 0x05;
+    page_store[1]  = 0x00;
+    page_store[2]  = 0x3b;
+    page_store[3]  = 0x03;
+    page_store[4]  = 0x06;
+    page_store[5]  = 0x00;
+    page_store[6]  = report_size & 0xff;
+    page_store[7]  = eeprom_payload ? (report_size >> 8) : 0x00;
+    page_store[8]  = 0x0B;
+    page_store[9]  = eeprom_page_size+5;
+    page_store[10] = 0xA2;
+    page_store[11] = (index / 256);
+    page_store[12] = (index % 256);
+    memcpy(page_store + 13, raw_data, eeprom_page_size);
+    page_store[eeprom_page_size + 13 + 0] = (checksum >> 8) & 0xff;
+    page_store[eeprom_page_size + 13 + 1] = (checksum >> 0) & 0xff;
+
+    return frame_size;
+}
+static int hid_eeprom_frame(uint8_t *page_store, int index, const uint8_t *raw_data, unsigned short checksum, int eeprom_page_size)
+{
+    int frame_size = eeprom_payload ? eeprom_page_size + 7 : fw_page_size*2 + 3;
+    memset(page_store, 0 , frame_size);
+
+    page_store[0] = 0x0B;
+    page_store[1] = eeprom_page_size + 5;
+    page_store[2] = 0xA2;
+    page_store[3] = (index / 256);
+    page_store[4] = (index % 256);
+    memcpy(page_store + 5, raw_data,(eeprom_page_size));
+    page_store[eeprom_page_size + 5 + 0] = (checksum >> 8) & 0xff;
+    page_store[eeprom_page_size + 5 + 1] = (checksum >> 0) & 0xff;
+
+    return frame_size;
+}
+static int hid_fw_frame(uint8_t *page_store, const uint8_t *raw_data, uint16_t checksum)
+{
+	page_store[0] = 0x0B;   //Report ID
+    	memcpy(page_store + 1, raw_data, fw_section_size);
+    	page_store[fw_section_size + 1 + 0] = (checksum >> 0) & 0xff;
+    	page_store[fw_section_size + 1 + 1] = (checksum >> 8) & 0xff;
+	
+	return fw_section_size + 3;
+}
+static int hid_send_frame(uint8_t *frame, int len)
+{
+	return hid_send_cmd(frame, len, 0, 0);
+}
+
+static struct elan_transport hid_transport = {
+	.name = "hid",
+	.write_cmd = hid_write_cmd,
+	.read_cmd = hid_read_cmd,
+	.fw_frame = hid_fw_frame,
+	.eeprom_frame = hid_eeprom_frame,
+	.send_frame = hid_send_frame,
+	.set_feature = hidraw_set_feature,
+	.get_feature = hidraw_get_feature,
+};
+
+static struct elan_transport i2c_transport = {
+	.name = "i2c",
+	.write_cmd = i2c_write_cmd,
+	.read_cmd = i2c_read_cmd,
+	.fw_frame = i2c_fw_frame,
+	.eeprom_frame = i2c_eeprom_frame,
+	.send_frame = i2c_send_frame,
+};
+
+static struct elan_transport hid_i2c_transport = {
+	.name = "hid-i2c",
+	.write_cmd = hid_i2c_write_cmd,
+	.read_cmd = hid_i2c_read_cmd,
+	.fw_frame = i2c_fw_frame,
+	.eeprom_frame = i2c_eeprom_frame,
+	.send_frame = i2c_send_frame,
+};
+
+static int sim_set_feature(uint8_t *buf, int len);
+static int sim_get_feature(uint8_t *buf, int len);
+
+static struct elan_transport sim_transport = {
+	.name = "sim",
+	.write_cmd = hid_write_cmd,
+	.read_cmd = hid_read_cmd,
+	.fw_frame = hid_fw_frame,
+	.eeprom_frame = hid_eeprom_frame,
+	.send_frame = hid_send_frame,
+	.set_feature = sim_set_feature,
+	.get_feature = sim_get_feature,
+};
+
+static struct elan_transport *transport = &hid_transport;
+
+static void elan_set_interface(int type)
+{
+	interface_type = type;
+	if (sim_enabled)
+		transport = &sim_transport;
+	else if (type == HID_INTERFACE)
+		transport = &hid_transport;
+	else if (type == HID_I2C_INTERFACE)
+		transport = &hid_i2c_transport;
+	else
+		transport = &i2c_transport;
+}
+
+/* The EEPROM and region commands need HID framing on plain I2C */
+static void elan_use_hid_i2c(void)
+{
+	if (interface_type == I2C_INTERFACE)
+		elan_set_interface(HID_I2C_INTERFACE);
+}
+
+static void elan_print_transport_stats(void)
+{
+	if (!transport->transactions)
+		return;
+	printf("Transport %s: %lu transactions, avg %.1f us\n",
+		transport->name, transport->transactions,
+		(double)transport->busy_us / transport->transactions);
+}
+
+static int _elan_write_fw_block(uint8_t *frame, int len)
+{
+	uint64_t start = elan_get_time_us();
+	int rv = transport->send_frame(frame, len);
+
+	elan_transport_account(start, STATS_OP_FRAME, -1);
+	if (rv)
+		return rv;
+
+	if((fw_section_size == fw_page_size) || (fw_section_cnt == fw_no_of_sections))
+	{
+		rv = elan_wait_fw_page();
+		fw_section_cnt = 0;
+		if (rv & (ETP_FW_IAP_PAGE_ERR | ETP_FW_IAP_INTF_ERR)) {
+			printf("IAP reports failed write : %x\n", rv);
+			fw_section_cnt++;
+			return rv;
+		}
+	}
+	fw_section_cnt++;
+	return 0;
+}
+
+static int elan_write_fw_block(uint8_t *frame, int len)
+{	
+	int rv;
+	for(int i=0; i<10 ; i++) {
+		rv = _elan_write_fw_block(frame, len);
+		if(rv==0)
+			return 0;
+		printf("Retry(%d)..\n", i);
+		SLEEP(50);
+	}
+	return rv;
+}
+
+/*
+ * Flash plan.  Once the page geometry is negotiated, and before the part
+ * is put into IAP mode, every frame of the update is built back to back
+ * together with its checksum and the checksum the part should report at
+ * the end.  The write loops then only send frames and wait.  With
+ * --flash-plan the plan is kept on disk and reused while the image,
+ * transport and geometry stay the same and its CRC32 still holds.
+ */
+#define PLAN_MAGIC			"ETPPLAN1"
+#define PLAN_MAIN			0
+#define PLAN_EEPROM			1
+
+struct elan_plan_header {
+	char magic[8];
+	uint64_t image_hash;
+	char transport[16];
+	int32_t kind;
+	int32_t page_size;
+	int32_t section_size;
+	int32_t iap_addr;
+	int32_t image_size;
+	int32_t flimforce_addr;
+	int32_t frame_size;		/* bytes reserved per frame */
+	int32_t count;
+	uint16_t checksum;		/* what the part reports once all frames are in */
+	uint16_t reserved;
+	uint32_t crc;			/* CRC32 of the frame table and frame data */
+};
+
+struct elan_plan_frame {
+	int32_t addr;			/* image offset, or EEPROM index */
+	uint16_t checksum;
+	uint16_t len;
+};
+
+static struct {
+	struct elan_plan_header hdr;
+	struct elan_plan_frame *frame;
+	uint8_t *data;
+	size_t capacity;
+} plan;
+
+static uint8_t *elan_plan_frame_data(int k)
+{
+	return plan.data + (size_t)k * plan.hdr.frame_size;
+}
+
+static void elan_plan_identity(struct elan_plan_header *hdr, int kind)
+{
+	memset(hdr, 0, sizeof(*hdr));
+	memcpy(hdr->magic, PLAN_MAGIC, sizeof(hdr->magic));
+	hdr->image_hash = fw_image_hash;
+	snprintf(hdr->transport, sizeof(hdr->transport), "%s", transport->name);
+	hdr->kind = kind;
+	hdr->page_size = fw_page_size;
+	hdr->section_size = (kind == PLAN_MAIN) ? fw_section_size : eeprom_payload;
+	hdr->iap_addr = (kind == PLAN_MAIN) ? elan_get_iap_addr() : 0;
+	hdr->image_size = fw_size;
+	hdr->flimforce_addr = (fw_size_all > 0) ? flimforce_addr : -1;
+}
+
+static int elan_plan_same_identity(const struct elan_plan_header *a,
+				   const struct elan_plan_header *b)
+{
+	return !memcmp(a->magic, b->magic, sizeof(a->magic)) &&
+		(a->image_hash == b->image_hash) &&
+		!strncmp(a->transport, b->transport, sizeof(a->transport)) &&
+		(a->kind == b->kind) && (a->page_size == b->page_size) &&
+		(a->section_size == b->section_size) && (a->iap_addr == b->iap_addr) &&
+		(a->image_size == b->image_size) &&
+		(a->flimforce_addr == b->flimforce_addr);
+}
+
+/* Covers the bytes each frame sends, not the slack after them */
+static uint32_t elan_plan_crc(void)
+{
+	uint32_t crc = elan_crc32(0, (const uint8_t *)plan.frame,
+				  (size_t)plan.hdr.count * sizeof(*plan.frame));
+
+	for (int k = 0; k < plan.hdr.count; k++)
+		crc = elan_crc32(crc, elan_plan_frame_data(k), plan.frame[k].len);
+	return crc;
+}
+
+static void elan_plan_reserve(int count, int frame_size)
+{
+	size_t need = (size_t)count * frame_size;
+
+	if (need > plan.capacity) {
+		free(plan.data);
+		plan.data = malloc(need);
+		plan.capacity = need;
+	}
+	free(plan.frame);
+	plan.frame = malloc(count * sizeof(*plan.frame));
+	if (!plan.data || !plan.frame)
+		request_exit("Out of memory for the flash plan (%d frames)\n", count);
+	plan.hdr.count = count;
+	plan.hdr.frame_size = frame_size;
+}
+
+static int elan_plan_load(const struct elan_plan_header *want)
+{
+	struct elan_plan_header hdr;
+	FILE *f = fopen(plan_path, "rb");
+
+	if (!f)
+		return -1;
+	if ((fread(&hdr, sizeof(hdr), 1, f) != 1) || !elan_plan_same_identity(&hdr, want) ||
+	    (hdr.count <= 0) || (hdr.count > MAX_FW_SIZE) ||
+	    (hdr.frame_size <= 0) || (hdr.frame_size > ETP_FRAME_BUF_SIZE)) {
+		fclose(f);
+		return -1;
+	}
+	elan_plan_reserve(hdr.count, hdr.frame_size);
+	plan.hdr = hdr;
+	if ((fread(plan.frame, sizeof(*plan.frame), hdr.count, f) != (size_t)hdr.count) ||
+	    (fread(plan.data, hdr.frame_size, hdr.count, f) != (size_t)hdr.count)) {
+		fclose(f);
+		plan.hdr.count = 0;
+		return -1;
+	}
+	fclose(f);
+	return 0;
+}
+
+static void elan_plan_save(void)
+{
+	char tmp[PATH_MAX + 8];
+	FILE *f;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", plan_path);
+	f = fopen(tmp, "wb");
+	if (!f ||
+	    (fwrite(&plan.hdr, sizeof(plan.hdr), 1, f) != 1) ||
+	    (fwrite(plan.frame, sizeof(*plan.frame), plan.hdr.count, f) != (size_t)plan.hdr.count) ||
+	    (fwrite(plan.data, plan.hdr.frame_size, plan.hdr.count, f) != (size_t)plan.hdr.count) ||
+	    (fclose(f) != 0) || (rename(tmp, plan_path) < 0)) {
+		printf("Flash plan: cannot write %s (%s)\n", plan_path, strerror(errno));
+		unlink(tmp);
+	}
+}
+
+#define PLAN_REUSED			1	/* built earlier in this process */
+#define PLAN_LOADED			2	/* read from --flash-plan, not yet checked */
+
+/* Says whether the plan in memory, or the one on disk, fits this update */
+static int elan_plan_reuse(int kind)
+{
+	struct elan_plan_header want;
+
+	elan_plan_identity(&want, kind);
+	if ((plan.hdr.count > 0) && elan_plan_same_identity(&plan.hdr, &want))
+		return PLAN_REUSED;
+	if (plan_path && (elan_plan_load(&want) == 0))
+		return PLAN_LOADED;
+	plan.hdr = want;
+	return 0;
+}
+
+/*
+ * Builds frame k of a plan into fr and buf and returns what it adds to
+ * the checksum the part reports at the end.  arg is the IAP address for
+ * main flash and the page size for EEPROM.
+ */
+typedef uint16_t (*plan_frame_fn)(int k, int count, int arg,
+				  struct elan_plan_frame *fr, uint8_t *buf);
+
+/*
+ * A plan read from disk is only trusted when it has the geometry the
+ * image gives now and its frame table and frames still match the CRC32
+ * stored when it was built.  Anything else is rebuilt.
+ */
+static int elan_plan_check(int count, int frame_size)
+{
+	if ((plan.hdr.count != count) || (plan.hdr.frame_size != frame_size))
+		return 0;
+	for (int k = 0; k < count; k++)
+		if (plan.frame[k].len > frame_size)
+			return 0;
+	return elan_plan_crc() == plan.hdr.crc;
+}
+
+/* Returns 1 when no new plan has to be built */
+static int elan_plan_ready(int kind, int count, int frame_size)
+{
+	switch (elan_plan_reuse(kind)) {
+	case PLAN_REUSED:
+		return 1;
+	case PLAN_LOADED:
+		if (elan_plan_check(count, frame_size)) {
+			printf("Flash plan: loaded %d frames from %s\n",
+				plan.hdr.count, plan_path);
+			return 1;
+		}
+		printf("Flash plan: %s is stale or damaged, rebuilding\n",
+			plan_path);
+		elan_plan_identity(&plan.hdr, kind);
+		return 0;
+	}
+	return 0;
+}
+
+static void elan_plan_build(int count, int frame_size, int arg, uint16_t extra,
+			    plan_frame_fn make)
+{
+	uint16_t total = extra;
+
+	elan_plan_reserve(count, frame_size);
+	for (int k = 0; k < count; k++)
+		total += make(k, count, arg, &plan.frame[k], elan_plan_frame_data(k));
+	plan.hdr.checksum = total;
+	plan.hdr.crc = elan_plan_crc();
+}
+
+static void elan_plan_done(uint64_t start)
+{
+	printf("Flash plan: %d frames, %zu bytes, built in %llu us\n",
+		plan.hdr.count, (size_t)plan.hdr.count * plan.hdr.frame_size,
+		(unsigned long long)(elan_get_time_us() - start));
+	if (plan_path)
+		elan_plan_save();
+}
+
+static int elan_page_blank(const uint8_t *data, int len)
+{
+	for (int i = 0; i < len; i++)
+		if (data[i] != 0xFF)
+			return 0;
+	return 1;
+}
+
+/*
+ * The part takes IAP pages strictly in order, so blank main flash pages
+ * cannot be left out; --count-blank only says how many there are.  The
+ * EEPROM is not erased by the IAP and cannot be read back, so its blank
+ * pages are written as well.
+ */
+static void elan_report_blank_pages(int start, int page_size, const char *why)
+{
+	int pages = 0, blank = 0;
+
+	for (int addr = start; addr < fw_size; addr += page_size, pages++)
+		blank += elan_page_blank(fw_data + addr, (fw_size - addr < page_size) ?
+					 fw_size - addr : page_size);
+	printf("Blank pages: %d of %d pages are all 0xFF, written anyway "
+	       "(%s)\n", blank, pages, why);
+}
+
+static uint16_t elan_flash_plan_frame(int k, int count, int iap_addr,
+				      struct elan_plan_frame *fr, uint8_t *buf)
+{
+	int addr = iap_addr + k * fw_section_size;
+
+	fr->addr = addr;
+	fr->checksum = elan_calc_checksum(fw_data + addr, fw_section_size);
+	fr->len = transport->fw_frame(buf, fw_data + addr, fr->checksum);
+	return fr->checksum;
+}
+
+static void elan_build_flash_plan(void)
+{
+	uint64_t start = elan_get_time_us();
+	int iap_addr = elan_get_iap_addr();
+	int count = (fw_size - iap_addr + fw_section_size - 1) / fw_section_size;
+	// For ic_type 0x12 0x13, claculate all checksum.
+	uint16_t extra = (fw_size_all > 0) ? fw_flimforce_area_checksum : 0;
+
+	if (count_blank)
+		elan_report_blank_pages(iap_addr, fw_page_size, "IAP takes pages in order");
+	if (elan_plan_ready(PLAN_MAIN, count, fw_section_size + 4))
+		return;
+	elan_plan_build(count, fw_section_size + 4, iap_addr, extra,
+			elan_flash_plan_frame);
+	elan_plan_done(start);
+}
+
+/*
+ * Same page order as before: clear page 0, pages 1.., then page 0 again.
+ * A short last page is padded from the zeroed slack past the image.
+ */
+static uint16_t elan_eeprom_plan_frame(int k, int count, int page_size,
+				       struct elan_plan_frame *fr, uint8_t *buf)
+{
+	uint8_t blank[ETP_MAX_PAGE_SIZE];
+	int index = ((k == 0) || (k == count - 1)) ? 0 : k * page_size;
+	const uint8_t *data = fw_data + index;
+
+	if (k == 0) {
+		memset(blank, 0xFF, page_size);
+		data = blank;
+	}
+	fr->addr = index;
+	fr->checksum = elan_eeprom_calc_checksum(data, page_size);
+	fr->len = transport->eeprom_frame(buf, index, data, fr->checksum, page_size);
+	return (k > 0) ? fr->checksum : 0;
+}
+
+static void elan_build_eeprom_plan(int page_size)
+{
+	uint64_t start = elan_get_time_us();
+	int count = (fw_size + page_size - 1) / page_size + 1;
+	int frame_size = eeprom_payload ? page_size + 16 : fw_page_size * 2 + 16;
+
+	if (count_blank)
+		elan_report_blank_pages(0, page_size, "the EEPROM is not known to be erased");
+	if (elan_plan_ready(PLAN_EEPROM, count, frame_size))
+		return;
+	elan_plan_build(count, frame_size, page_size, 0, elan_eeprom_plan_frame);
+	elan_plan_done(start);
+}
+
+/*
+ * Progress journal.  The part takes IAP pages in order and keeps its
+ * place across a dead host process, so the page after the last one it
+ * confirmed is where a rerun has to continue.  The record is rewritten
+ * in place and synced once per confirmed page.
+ */
+#define JOURNAL_MAGIC			"ETPJRNL1"
+
+struct elan_journal {
+	char magic[8];
+	uint64_t image_hash;
+	int32_t image_size;
+	int32_t iap_addr;
+	int32_t page_size;
+	int32_t section_size;
+	int32_t flimforce_addr;
+	int32_t next_addr;		/* first byte not confirmed by the part */
+	uint16_t module_id;
+	uint16_t ic_type;
+	uint16_t checksum;		/* sections confirmed so far */
+	uint16_t flimforce_checksum;
+};
+
+static int journal_fd = -1;
+static struct elan_journal journal;
+
+static uint64_t elan_page_hash(const uint8_t *data, int len)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;		/* FNV-1a */
+
+	for (int i = 0; i < len; i++) {
+		hash ^= data[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+static void elan_journal_begin(void)
+{
+	if (!journal_path)
+		return;
+	if (!strcmp(journal_path, JOURNAL_DEFAULT_PATH))
+		mkdir(MANIFEST_DEFAULT_DIR, 0755);
+	journal_fd = open(journal_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (journal_fd < 0) {
+		printf("Journal: cannot open %s (%s), an interrupted update "
+		       "will not resume\n", journal_path, strerror(errno));
+		return;
+	}
+	memset(&journal, 0, sizeof(journal));
+	memcpy(journal.magic, JOURNAL_MAGIC, sizeof(journal.magic));
+	journal.image_hash = fw_image_hash;
+	journal.image_size = fw_size;
+	journal.iap_addr = elan_get_iap_addr();
+	journal.page_size = fw_page_size;
+	journal.section_size = fw_section_size;
+	journal.flimforce_addr = (fw_size_all > 0) ? flimforce_addr : -1;
+	journal.module_id = module_id;
+	journal.ic_type = ic_type;
+	journal.flimforce_checksum = fw_flimforce_area_checksum;
+}
+
+static void elan_journal_commit(int next_addr, uint16_t checksum)
+{
+	if (journal_fd < 0)
+		return;
+	journal.next_addr = next_addr;
+	journal.checksum = checksum;
+	if ((pwrite(journal_fd, &journal, sizeof(journal), 0) != sizeof(journal)) ||
+	    (fdatasync(journal_fd) < 0)) {
+		printf("\nJournal: write to %s failed (%s), continuing without it\n",
+			journal_path, strerror(errno));
+		close(journal_fd);
+		journal_fd = -1;
+		unlink(journal_path);
+	}
+}
+
+static void elan_journal_finish(void)
+{
+	if (journal_fd >= 0)
+		close(journal_fd);
+	journal_fd = -1;
+	if (journal_path)
+		unlink(journal_path);
+}
+
+/*
+ * Send the planned frames for [start, end) of the image.  The returned
+ * checksum always covers the whole image, so a delta write that stops
+ * early can be compared with the IAP checksum the part reports.
+ */
+static uint16_t elan_update_firmware(int start, int end)
+{
+	uint16_t checksum = 0;
+	int rv, k;
+	int iap_addr = elan_get_iap_addr();
+#ifdef ETP_COUNT_ALLOCS
+	unsigned long heap_start = heap_allocations;
+#endif
+
+	/* Pages the part confirmed before an interrupted update */
+	for (k = 0; (k < plan.hdr.count) && (plan.frame[k].addr < start); k++)
+		checksum += plan.frame[k].checksum;
+	fw_section_cnt = 1;
+	for (; (k < plan.hdr.count) && (plan.frame[k].addr < end); k++) {
+		int i = plan.frame[k].addr;
+
+		rv = elan_write_fw_block(elan_plan_frame_data(k), plan.frame[k].len);
+		checksum += plan.frame[k].checksum;
+		printf("\rPage %3d is updated, checksum: %d, section: %d",
+			i / fw_page_size, checksum, fw_section_cnt);
+		fflush(stdout);
+		if (rv)
+			request_exit("Failed to update.");
+		if ((i + fw_section_size - iap_addr) % fw_page_size == 0)
+			elan_journal_commit(i + fw_section_size, checksum);
+	}
+	printf("\n");
+#ifdef ETP_COUNT_ALLOCS
+	printf("Heap allocations in write loop: %lu\n",
+		heap_allocations - heap_start);
+#endif
+	if (poll_mode)
+		elan_print_page_wait();
+	/* Pages left out by a delta write are already on the part */
+	return plan.hdr.checksum;
+}
+int finish_update_fw()
+{
+    int ret = elan_disable_long_transmmison_mode();
+    if(ret < 0)
+    {
+	printf("Disable Long Transmmison mode FAIL  (%x) !!\n", ret);
+        ret = -30;
+    }
+    ret = elan_disable_eeprom_iap_mode();
+    if(ret < 0)
+    {
+        printf("Disable EEPROM IAP mode FAIL  (%x) !!\n", ret);
+        ret = -31;	
+    }
+    return ret;
+}
+
+static int elan_write_eeprom_block(uint8_t *frame, int len)
+{
+    uint64_t start = elan_get_time_us();
+    int rv = transport->send_frame(frame, len);
+
+    elan_transport_account(start, STATS_OP_FRAME, -1);
+    if (rv)
+    	return rv;
+
+    if(fw_page_size == 512)
+	SLEEP(50 *1000);
+    else
+	SLEEP(35 * 1000);
+
+    int ret = elan_set_eeprom_datatype();
+    if(ret < 0)
+    {
+	printf("Set EEPROM DataType FAIL  (%x) !!\n", ret);
+        return -1;
+    }
+
+    ret=elan_get_eeprom_iap_ctrl();
+    if(ret==0)
+    {
+	printf("EEPROM IAP reports failed write %d\n", ret);
+        return -1;
+    }
+    else if(ret==-1)
+	return -2;
+    
+    return 0;
+}
+
+/*
+ * --eeprom-burst.  Frames end after the checksum instead of being padded
+ * to twice the IAP page, and the payload per write is the largest of
+ * 128, 64 and 32 bytes the driver IC takes in long transmission mode.
+ * The probe is the clear of page 0, which is rewritten last anyway, so
+ * a payload the part turns down costs one frame.  Returns the number of
+ * plan frames already written, or a negative error.
+ */
+static int elan_eeprom_negotiate(void)
 {
-    if(elan_write_cmd(0x0321, 0x060F)) {
-	usleep(20 * 1000);
-	return elan_write_cmd(0x0321, 0x060F);	
+    static const int payloads[] = { 128, 64, 32 };
+    int rv;
+
+    for (int i = 0; i < (int)(sizeof(payloads) / sizeof(payloads[0])); i++) {
+	eeprom_payload = payloads[i];
+	elan_build_eeprom_plan(eeprom_payload);
+	rv = elan_write_eeprom_block(elan_plan_frame_data(0), plan.frame[0].len);
+	if (rv == 0) {
+	    printf("EEPROM: %d byte writes in %d byte frames\n",
+		eeprom_payload, plan.frame[0].len);
+	    return 1;
+	}
+	if (rv == -2)
+	    return rv;
     }
+    /* Not even 32 bytes in a short frame, back to the full size ones */
+    printf("EEPROM: no short frame accepted, using %d byte writes\n",
+	ETP_EEPROM_PAGE_SIZE);
+    eeprom_payload = 0;
+    elan_build_eeprom_plan(ETP_EEPROM_PAGE_SIZE);
     return 0;
 }
 
-static int elan_read_eeprom_checksum()
+int eeprom_write_page(int k,  unsigned short *checksum, int page_size)
+{
+    int index = plan.frame[k].addr;
+    unsigned short block_checksum = plan.frame[k].checksum;
+    int rv;
+    int error_count=0;
+
+    do
+    {
+	    rv = elan_write_eeprom_block(elan_plan_frame_data(k), plan.frame[k].len);
+
+	    fflush(stdout);
+	    if (rv==-1)
+	    {
+		error_count++;
+	       	if(error_count<10)
+		    	printf("\nRetry update page %d,  count = %d\n", index /page_size, error_count);
+	       	else
+	      		return -1;
+	    }
+	    else if(rv==-2)
+		return -2;
+	    else
+	    {
+		*checksum += block_checksum;
+	      	printf("\rPage %3d is updated, block_checksum: %4x checksum: %4x",
+		        index / page_size,  block_checksum, *checksum);
+		return 0;
+	    }
+    }while(1);
+}
+
+
+static int elan_eeprom_update_firmware(void)
+{
+    int rv;
+    int ret_prepare=elan_eeprom_prepare_for_update();
+    unsigned short check_sum=0;
+    int eeprom_fw_page_size=ETP_EEPROM_PAGE_SIZE;
+#ifdef ETP_COUNT_ALLOCS
+    unsigned long heap_start;
+#endif
+    uint64_t start_us, wire_bytes = 0;
+    int first = 0;
+    
+    SLEEP(100 * 1000);
+    if(ret_prepare<0)
+    {
+	printf("-2 .prepare update fw error.. : return %d\n",ret_prepare);
+		rv=-2;
+        	goto exit;  
+    }
+    
+    elan_stats_phase(PHASE_FLASH);
+    start_us = elan_get_time_us();
+    if (eeprom_burst) {
+	first = elan_eeprom_negotiate();
+	if (first < 0) {
+		printf("Failed to update. (%d)\n", first);
+		rv=-3;
+		goto exit;
+	}
+	if (eeprom_payload)
+		eeprom_fw_page_size = eeprom_payload;
+    }
+#ifdef ETP_COUNT_ALLOCS
+    heap_start = heap_allocations;
+#endif
+    for(int k=first; k<plan.hdr.count; k++)
+    {
+	rv =  eeprom_write_page(k, &check_sum, eeprom_fw_page_size);
+	//clear first page
+	if(k==0)
+		check_sum=0;
+	if (rv<0)
+	{
+		printf("Failed to update. (%d)\n", rv);
+		rv=-3;
+        	goto exit;    
+	}
+
+    }
+    printf("\n");
+#ifdef ETP_COUNT_ALLOCS
+    printf("Heap allocations in write loop: %lu\n",
+	heap_allocations - heap_start);
+#endif
+    for(int k=0; k<plan.hdr.count; k++)
+	wire_bytes += plan.frame[k].len;
+    start_us = elan_get_time_us() - start_us;
+    printf("EEPROM: %d bytes in %d frames, %llu bytes on the wire "
+	"(%.0f%% payload), %.1f KiB/s\n", fw_size, plan.hdr.count,
+	(unsigned long long)wire_bytes, 100.0 * fw_size / wire_bytes,
+	start_us ? fw_size * 1e6 / 1024 / start_us : 0.0);
+    elan_stats_phase(PHASE_VERIFY);
+    rv=finish_update_fw();
+    if(rv<0)
+    {
+	printf( "-4 .finish_update_fw error (%d)..\n", rv);
+        rv=-4;
+        goto exit;       	
+    }
+
+    SLEEP(2 * 1000);
+    rv = elan_read_eeprom_checksum_process();
+    if (rv >= 0)
+	printf("EEPROM checksum computed in %.1f ms (%d polls)\n",
+		eeprom_checksum_us / 1000.0, eeprom_checksum_polls);
+    if (rv != check_sum) {
+	printf("Update FAIL: checksum diff local=[%04X], remote=[%04X]\n",
+		check_sum, rv);
+        goto exit;
+    }
+    for(int i=0; i<3; i++)
+    {
+    	rv = elan_write_info_eeprom_checksum(check_sum & 0xFFFF);
+	if(rv>0)
+		i=3;
+    }
+    if(rv<0)
+	printf("Update PASS. (0x%04x) ; Informatin area record fail (%d)\n", check_sum, rv);
+    else
+	printf("Update PASS. (0x%04x)\n", check_sum);
+
+exit:
+    elan_stats_phase(PHASE_RESET);
+    elan_restart_driver_ic();
+    elan_reset_tp();
+    
+    elan_wait_ready(READY_EEPROM, 1500 * 1000);
+    return rv;
+}
+/*
+ * In-process ELAN touchpad model.
+ *
+ * Stands in for /dev/hidraw when --sim is given.  It decodes the feature
+ * reports hid_send_cmd() produces: report 0x0D carries register writes
+ * (reg, value) and register read requests (0x0305, reg), report 0x0B
+ * carries IAP page sections and EEPROM pages.  Page programming, resets
+ * and the EEPROM checksum computation keep the model busy for a
+ * configurable time, during which every report fails like a NAKing device.
+ */
+#define SIM_READ_REQUEST		0x0305
+#define SIM_EEPROM_PAGE_TAG		0xA2
+#define SIM_EEPROM_STATUS_OK		0x0800
+#define SIM_EEPROM_STATUS_RESEND	0x1000
+#define SIM_EEPROM_STATUS_BUSY		0x0020
+
+struct elan_sim {
+	/* Configuration */
+	uint8_t ic_type;
+	int iap_version;
+	int module_id;
+	int fw_version;
+	int hw_id;
+	int section_size;
+	int page_latency_us;
+	int reset_latency_us;
+	int eeprom_calc_us;
+	int eeprom_max_payload;		/* largest EEPROM write in long transmission */
+	int io_latency_us;		/* per report, on top of the busy time */
+	int eeprom;
+	int image_rev;
+	int stuck_pages;
+
+	/* Geometry derived from the configuration */
+	int image_size;
+	int page_size;
+	int iap_addr;
+	int flimforce_addr;
+
+	/* Registers */
+	uint16_t ctrl;
+	uint16_t iap_cmd;
+	uint16_t password;
+	uint16_t iap_type;
+	uint16_t region;
+	uint16_t eeprom_reg;
+	uint16_t long_tx;
+	uint16_t info_checksum;
+	int read_reg;
+
+	/* Programming state */
+	int in_iap;
+	int eeprom_iap;
+	int eeprom_error;
+	int write_addr;
+	int page_fill;
+	uint64_t busy_until;
+	uint64_t eeprom_busy_until;
+	uint8_t page[512];
+	uint8_t flash[MAX_FW_SIZE];
+	uint8_t eeprom_data[MAX_FW_SIZE];
+	int eeprom_size;
+};
+
+static struct elan_sim sim = {
+	.ic_type = 0x10,
+	.iap_version = 2,
+	.module_id = 0x0213,
+	.fw_version = 0x0a,
+	.hw_id = 0x10,
+	.section_size = 128,
+	.page_latency_us = 15 * 1000,
+	.reset_latency_us = 250,
+	.eeprom_calc_us = 60 * 1000,
+	.eeprom_max_payload = 128,
+	.eeprom = 1,
+	.image_rev = 1,
+	.stuck_pages = -1,
+};
+
+static int sim_parse_spec(char *spec)
+{
+	enum { SIM_IC, SIM_IAP, SIM_MODULE, SIM_FW, SIM_SECTION,
+	       SIM_LATENCY, SIM_RESET, SIM_EEPROM, SIM_REV, SIM_STUCK,
+	       SIM_FORCE, SIM_CALC, SIM_IO, SIM_PAYLOAD };
+	char *const tokens[] = { "ic", "iap", "module", "fw", "section",
+				 "latency", "reset", "eeprom", "rev", "stuck",
+				 "force", "calc", "io", "payload", NULL };
+	char *value, *e;
+
+	while (*spec) {
+		int idx = getsubopt(&spec, tokens, &value);
+		if ((idx < 0) || !value) {
+			printf("Invalid simulator option: \"%s\"\n", value ? value : "");
+			return -1;
+		}
+		int v = (int) strtoul(value, &e, 0);
+		if (!*value || (e && *e)) {
+			printf("Invalid argument: \"%s\"\n", value);
+			return -1;
+		}
+		switch (idx) {
+		case SIM_IC:
+			sim.ic_type = v;
+			break;
+		case SIM_IAP:
+			sim.iap_version = v;
+			break;
+		case SIM_MODULE:
+			sim.module_id = v;
+			break;
+		case SIM_FW:
+			sim.fw_version = v;
+			break;
+		case SIM_SECTION:
+			sim.section_size = v;
+			break;
+		case SIM_LATENCY:
+			sim.page_latency_us = v;
+			break;
+		case SIM_RESET:
+			sim.reset_latency_us = v;
+			break;
+		case SIM_EEPROM:
+			sim.eeprom = v;
+			break;
+		case SIM_REV:
+			sim.image_rev = v;
+			break;
+		case SIM_STUCK:
+			sim.stuck_pages = v;
+			break;
+		case SIM_FORCE:
+			sim.flimforce_addr = v;
+			break;
+		case SIM_CALC:
+			sim.eeprom_calc_us = v;
+			break;
+		case SIM_IO:
+			sim.io_latency_us = v;
+			break;
+		case SIM_PAYLOAD:
+			sim.eeprom_max_payload = v;
+			break;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Synthetic image for the configured part: header words, pseudo-random
+ * code over the first 60% and 0xFF padding after that, with signatures
+ * at the end of the part and in front of the flimforce table.
+ */
+static void sim_build_image(uint8_t *image, int rev)
+{
+	static const uint8_t signature[] = {0xAA, 0x55, 0xCC, 0x33, 0xFF, 0xFF};
+	int iap_addr = (sim.image_size / 8) & ~511;
+	int unique_addr = iap_addr + 0x40;
+	int flimforce_addr = sim.image_size - 2048;
+	uint32_t seed = 0x454C414E + rev;
+
+	memset(image, 0xFF, sim.image_size);
+	for (int i = 0x200; i < sim.image_size * 6 / 10; i++) {
+		seed = seed * 1103515245 + 12345;
+		image[i] = seed >> 16;
+	}
+	le_int_to_bytes(image + ETP_IAP_VER_ADDR * 2, sim.iap_version);
+	le_int_to_bytes(image + ETP_IAP_START_ADDR * 2, iap_addr / 2);
+	le_int_to_bytes(image + ETP_IAP_FLIMFORCE_ADDR_V5 * 2, flimforce_addr / 2);
+	le_int_to_bytes(image + iap_addr, unique_addr / 2);
+	le_int_to_bytes(image + iap_addr + 6, flimforce_addr / 2);
+	le_int_to_bytes(image + unique_addr, sim.module_id);
+	memcpy(image + flimforce_addr - FW_SIGNATURE_SIZE, signature, FW_SIGNATURE_SIZE);
+	memcpy(image + sim.image_size - FW_SIGNATURE_SIZE, signature, FW_SIGNATURE_SIZE);
+}
+
+/* Words per IAP section after a reset */
+static int sim_default_iap_type(void)
+{
+	if ((sim.page_size == 512) && (sim.iap_version >= 3))
+		return sim.section_size / 2;
+	return sim.page_size / 2;
+}
+
+static void sim_setup(void)
+{
+	int page_count = elan_ic_type_page_count(sim.ic_type);
+
+	if (page_count < 0)
+		request_exit("The IC type is not supported (%x).\n", sim.ic_type);
+
+	sim.image_size = page_count * FW_PAGE_SIZE;
+	sim.page_size = 64;
+	if ((sim.ic_type >= 0x10) && (sim.iap_version >= 1)) {
+		if ((sim.iap_version >= 2) && ((sim.ic_type == 0x14) || (sim.ic_type == 0x15)))
+			sim.page_size = 512;
+		else
+			sim.page_size = 128;
+	}
+	sim.iap_type = sim_default_iap_type();
+
+	sim_build_image(sim.flash, 0);
+	sim.iap_addr = le_bytes_to_int(sim.flash + ETP_IAP_START_ADDR * 2) * 2;
+	if (sim.flimforce_addr <= 0)
+		sim.flimforce_addr = sim.image_size - 2048;
+	sim.ctrl = ETP_I2C_MAIN_MODE_ON;
+	sim.region = 0xFFFF;
+	memset(sim.eeprom_data, 0xFF, sizeof(sim.eeprom_data));
+
+	/* Left in IAP mode by an update that died after stuck pages */
+	if (sim.stuck_pages >= 0) {
+		sim.in_iap = 1;
+		sim.ctrl = ETP_FW_IAP_CHECK_PW;
+		sim.write_addr = sim.iap_addr + sim.stuck_pages * sim.page_size;
+	}
+}
+
+static int sim_dump_image(const char *path)
+{
+	uint8_t *image = malloc(sim.image_size);
+	FILE *f = fopen(path, "wb");
+
+	if (!image || !f) {
+		free(image);
+		if (f)
+			fclose(f);
+		printf("Cannot write image: %s\n", path);
+		return -1;
+	}
+	sim_build_image(image, sim.image_rev);
+	int ret = fwrite(image, 1, sim.image_size, f) == (size_t)sim.image_size ? 0 : -1;
+	fclose(f);
+	free(image);
+	if (ret == 0)
+		printf("%s: IC type %x, IAP version %x, module id %x, %d bytes\n",
+			path, sim.ic_type, sim.iap_version, sim.module_id, sim.image_size);
+	return ret;
+}
+
+static void sim_reset(uint64_t now)
+{
+	sim.iap_type = sim_default_iap_type();
+	sim.in_iap = 0;
+	sim.eeprom_iap = 0;
+	sim.page_fill = 0;
+	sim.iap_cmd = 0;
+	sim.password = 0;
+	sim.long_tx = 0;
+	sim.ctrl = ETP_I2C_MAIN_MODE_ON;
+	sim.busy_until = now + sim.reset_latency_us;
+}
+
+static void sim_enter_iap(uint16_t pw, uint64_t now)
+{
+	uint16_t expected = (sim.ic_type == 0x0A) ?
+		ETP_I2C_IAP_0A_PASSWORD : ETP_I2C_IAP_PASSWORD;
+
+	sim.iap_cmd = pw;
+	if ((pw != expected) ||
+	    ((sim.ic_type == 0x13) && (sim.iap_version >= 5) &&
+	     (sim.password != ETP_I2C_IC13_IAPV5_PW))) {
+		sim.ctrl = 0;
+		return;
+	}
+	sim.in_iap = 1;
+	sim.write_addr = sim.iap_addr;
+	sim.page_fill = 0;
+	sim.ctrl = ETP_FW_IAP_CHECK_PW;
+	sim.busy_until = now + sim.reset_latency_us;
+}
+
+static uint16_t sim_eeprom_checksum(void)
+{
+	return elan_eeprom_calc_checksum(sim.eeprom_data, sim.eeprom_size);
+}
+
+static void sim_write_eeprom_reg(uint16_t val, uint64_t now)
+{
+	sim.eeprom_reg = val;
+	switch (val) {
+	case 0x0607:
+		sim.eeprom_iap = 1;
+		break;
+	case 0x0606:
+	case 0x0601:
+		sim.eeprom_iap = 0;
+		break;
+	case 0x060F:
+		sim.eeprom_busy_until = now + sim.eeprom_calc_us;
+		break;
+	case 0x0702:
+		sim.eeprom_reg = SIM_EEPROM_STATUS_OK;
+		if (sim.eeprom_error)
+			sim.eeprom_reg |= SIM_EEPROM_STATUS_RESEND;
+		if (now < sim.eeprom_busy_until)
+			sim.eeprom_reg |= SIM_EEPROM_STATUS_BUSY;
+		break;
+	case 0x070A:
+		sim.eeprom_reg = sim_eeprom_checksum();
+		break;
+	case 0x0710:	/* day, month, serial */
+		sim.eeprom_reg = 15 | (6 << 8) | (1 << 12);
+		break;
+	case 0x0711:	/* year, EEPROM IAP version */
+		sim.eeprom_reg = 21 | (1 << 8);
+		break;
+	}
+}
+
+static void sim_write_reg(int reg, uint16_t val, uint64_t now)
+{
+	switch (reg) {
+	case SIM_READ_REQUEST:
+		sim.read_reg = val;
+		break;
+	case ETP_I2C_IAP_RESET_CMD:
+		if (val == ETP_I2C_IAP_RESET)
+			sim_reset(now);
+		break;
+	case ETP_I2C_IAP_CMD:
+		/* The information area unlock reuses the IAP password */
+		if ((sim.long_tx != 0x4600) &&
+		    ((val == ETP_I2C_IAP_PASSWORD) || (val == ETP_I2C_IAP_0A_PASSWORD)))
+			sim_enter_iap(val, now);
+		else
+			sim.iap_cmd = val;
+		break;
+	case ETP_I2C_PASSWORD_CMD:
+		sim.password = val;
+		break;
+	case ETP_I2C_IAP_TYPE_CMD:
+		/* Sections beyond the default size need long transmission */
+		if ((val <= sim_default_iap_type()) ||
+		    ((sim.long_tx == 0x4607) && (val * 2 <= sim.page_size)))
+			sim.iap_type = val;
+		break;
+	case ETP_I2C_REGION_CMD:
+		if (sim.iap_cmd == ETP_I2C_FLASH_REGION)
+			sim.region = val;
+		break;
+	case 0x0321:
+		sim_write_eeprom_reg(val, now);
+		break;
+	case 0x0322:
+		sim.long_tx = val;
+		break;
+	case 0x048b:
+		sim.info_checksum = val;
+		break;
+	}
+}
+
+static uint16_t sim_read_reg(int reg)
+{
+	switch (reg) {
+	case ETP_GET_HARDWARE_ID_CMD:
+		return 0x0100 | sim.hw_id;
+	case ETP_GET_MODULE_ID_CMD:
+		return sim.module_id;
+	case ETP_I2C_FW_VERSION_CMD:
+		/* No main firmware runs in IAP mode to answer */
+		if (!(sim.ctrl & ETP_I2C_MAIN_MODE_ON))
+			return 0xFFFF;
+		return sim.fw_version;
+	case ETP_I2C_OSM_VERSION_CMD:
+		return sim.ic_type << 8;
+	case ETP_I2C_FLIM_TYPE_ENABLE_CMD:
+		if (!sim.eeprom)
+			return 0;
+		return ETP_FW_FLIM_TYPE_ENABLE_BIT | ETP_FW_EEPROM_ENABLE_BIT | (2 << 4);
+	case ETP_I2C_NEW_IAP_VERSION_CMD:
+		return (sim.iap_version << 8) | sim.ic_type;
+	case ETP_I2C_IAP_VERSION_CMD:
+		return sim.iap_version;
+	case ETP_I2C_IAP_CHECKSUM_CMD:
+		return elan_calc_checksum(sim.flash + sim.iap_addr,
+					  sim.image_size - sim.iap_addr);
+	case ETP_I2C_FW_CHECKSUM_CMD:
+		return elan_calc_checksum(sim.flash, sim.iap_addr);
+	case ETP_I2C_IAP_CTRL_CMD:
+		return sim.ctrl;
+	case ETP_I2C_IAP_CMD:
+		return sim.iap_cmd;
+	case ETP_I2C_PASSWORD_CMD:
+		return sim.password;
+	case ETP_I2C_IAP_TYPE_CMD:
+		return sim.iap_type;
+	case ETP_I2C_FLIMFORCE_ADDR_CMD:
+		return sim.flimforce_addr / 2;
+	case ETP_I2C_REGION_CMD:
+		return sim.region;
+	case 0x0321:
+		return sim.eeprom_reg;
+	case 0x0322:
+		return sim.long_tx;
+	case 0x048b:
+		return sim.info_checksum;
+	}
+	return 0xFFFF;
+}
+
+static void sim_write_section(uint8_t *data, int len, uint16_t checksum, uint64_t now)
+{
+	if (!sim.in_iap) {
+		sim.ctrl |= ETP_FW_IAP_INTF_ERR;
+		return;
+	}
+	if ((len <= 0) || (len > sim.iap_type * 2) ||
+	    (sim.page_fill + len > sim.page_size) ||
+	    (elan_calc_checksum(data, len) != checksum)) {
+		sim.ctrl |= ETP_FW_IAP_PAGE_ERR;
+		return;
+	}
+	memcpy(sim.page + sim.page_fill, data, len);
+	sim.page_fill += len;
+	if (sim.page_fill < sim.page_size)
+		return;
+
+	memcpy(sim.flash + sim.write_addr, sim.page, sim.page_size);
+	sim.write_addr += sim.page_size;
+	sim.page_fill = 0;
+	sim.ctrl = ETP_FW_IAP_CHECK_PW;
+	sim.busy_until = now + sim.page_latency_us;
+
+	/* The last page ends IAP and the part restarts on its own */
+	if (sim.write_addr >= sim.image_size) {
+		sim_reset(sim.busy_until);
+		sim.busy_until += sim.page_latency_us;
+	}
+}
+
+static void sim_write_eeprom_page(uint8_t *buf, int len, uint64_t now)
+{
+	int size = buf[1] - 5;
+	int index = (buf[3] << 8) | buf[4];
+
+	sim.eeprom_error = 1;
+	if ((size <= 0) || (5 + size + 2 > len) || (index + size > MAX_FW_SIZE))
+		return;
+	/* Writes over 32 bytes need long transmission */
+	if ((size > ETP_EEPROM_PAGE_SIZE) &&
+	    ((sim.long_tx != 0x4607) || (size > sim.eeprom_max_payload)))
+		return;
+	uint16_t checksum = (buf[5 + size] << 8) | buf[5 + size + 1];
+	if (elan_eeprom_calc_checksum(buf + 5, size) != checksum)
+		return;
+
+	memcpy(sim.eeprom_data + index, buf + 5, size);
+	if (index + size > sim.eeprom_size)
+		sim.eeprom_size = index + size;
+	sim.eeprom_error = 0;
+	sim.busy_until = now + sim.page_latency_us;
+}
+
+static int sim_set_feature(uint8_t *buf, int len)
+{
+	uint64_t now;
+
+	if (sim.io_latency_us)
+		usleep(sim.io_latency_us);
+	now = elan_get_time_us();
+
+	if (now < sim.busy_until) {
+		errno = EAGAIN;
+		return -1;
+	}
+	switch (buf[0]) {
+	case 0x0D:
+		if (len < 5)
+			break;
+		sim_write_reg(buf[1] | (buf[2] << 8), buf[3] | (buf[4] << 8), now);
+		return len;
+	case 0x0B:
+		if (len < 3)
+			break;
+		if (sim.eeprom_iap && (buf[2] == SIM_EEPROM_PAGE_TAG))
+			sim_write_eeprom_page(buf, len, now);
+		else
+			sim_write_section(buf + 1, len - 3,
+					  le_bytes_to_int(buf + len - 2), now);
+		return len;
+	}
+	errno = EINVAL;
+	return -1;
+}
+
+static int sim_get_feature(uint8_t *buf, int len)
 {
-    if(elan_write_cmd(0x0321, 0x070A)) {
-	usleep(20 * 1000);
-	if(elan_write_cmd(0x0321, 0x070A)) {
+	uint64_t now;
+
+	if (sim.io_latency_us)
+		usleep(sim.io_latency_us);
+	now = elan_get_time_us();
+
+	if (now < sim.busy_until) {
+		errno = EAGAIN;
 		return -1;
-	}	
-    }
-    elan_read_cmd(0x0321);
-    return le_bytes_to_int(rx_buf);
+	}
+	memset(buf + 1, 0, len - 1);
+	if ((buf[0] == 0x0D) && (len >= 5)) {
+		le_int_to_bytes(buf + 1, sim.read_reg);
+		le_int_to_bytes(buf + 3, sim_read_reg(sim.read_reg));
+	}
+	return len;
 }
 
-static int elan_read_eeprom_checksum_process()
+/*
+ * Update policy.  The expected state is computed from fw_data alone and
+ * compared with plain register reads, so a device that already runs the
+ * image is skipped before report mode is disabled or IAP is entered.
+ *
+ * The IAP checksum covers everything from the IAP start address to the
+ * end of the part.  Flimforce fill blocks are built to sum to zero, so
+ * this holds on parts with a flimforce table as well.
+ */
+static int elan_image_expected_checksum(int page_count)
 {
-    int rv=elan_calc_eeprom_checksum();
-    int cnt=0;
-    if(rv<0)
-    {
-	printf( "Calc eeprom checksum cmd error..  \n");
-        rv=-5;	
-        return rv;
-
-    }
-wait:
-    usleep(100 * 1000);
-    rv = elan_set_eeprom_datatype();
-    if(rv<0)
-    {
-	printf( "set eeprom datatype cmd error..  \n");
-        rv=-6;
-        return rv;
-    }
+	int iap_addr = elan_get_iap_addr();
+	int size = page_count * FW_PAGE_SIZE;
 
-    elan_read_cmd(0x0321);
-    rv = le_bytes_to_int(rx_buf);
-    if((rv & 0x20)==0x20)
-    {	
-	cnt++;
-	if(cnt>=100)
-	{
-		printf( "Read eeprom checksum error.. (1) \n");
-		rv=-7;
-		return rv;
-	}
-	else
- 		goto wait;
-    }
+	if ((iap_addr <= 0) || (iap_addr >= size))
+		return -1;
+	return elan_calc_checksum(fw_data + iap_addr, size - iap_addr);
+}
 
-    for(int i=0; i<3; i++)
-    {
-    	rv=elan_read_eeprom_checksum();
-     	if(rv>0)
-		i=3;
-	else
-		usleep(100 * 1000);
+/* Mirrors the page order of elan_eeprom_update_firmware() */
+static int elan_eeprom_expected_checksum(int size, int page_size)
+{
+	uint16_t checksum = elan_eeprom_calc_checksum(fw_data, page_size);
 
-    }
-    if(rv<0)
-    {
-	printf( "Read eeprom checksum error.. (2)  \n");
-	rv=-8;
-        return rv;
-    }
-    return rv;	
+	for (int i = page_size; i < size; i += page_size)
+		checksum += elan_eeprom_calc_checksum(fw_data + i, page_size);
+	return checksum;
 }
 
-static int elan_read_eeprom_version()
+static int elan_skip_main_update(void)
 {
-    unsigned short v_s=0;
-    unsigned short v_d=0;
-    unsigned short v_m=0;
-    unsigned short v_y=0;
-    char buf[256] = "\0";
-    
-   if(elan_write_cmd(0x0321, 0x0710)) {
-	usleep(20 * 1000);
-	if(elan_write_cmd(0x0321, 0x0710))
-		return -2;
-    }
-    elan_read_cmd(0x0321);
-    v_d = rx_buf[0];
-    v_m = rx_buf[1] & 0xF;
-    v_s = (rx_buf[1] & 0xF0) >> 4;
+	int page_count = elan_get_ic_page_count();
 
-    if(elan_write_cmd(0x0321, 0x0711)) {
-	usleep(20 * 1000);
-	if(elan_write_cmd(0x0321, 0x0711)) 
-		return -3;
-    }
-    elan_read_cmd(0x0321);
-    v_y = rx_buf[0];
-    eeprom_iap_version = rx_buf[1];
+	is_new_pattern = elan_get_patten();
+	if (only_newer >= 0) {
+		int version = elan_get_version(0);
+		/* A part stuck in IAP mode has no version, it needs the update */
+		if ((version != 0xFFFF) && (version != ETP_I2C_FW_VERSION_CMD) &&
+		    (version >= only_newer)) {
+			printf("Skip update: FW version %x is not older than %x\n",
+				version, only_newer);
+			return 1;
+		}
+	}
+	if (!skip_identical)
+		return 0;
 
-    if((v_y==0xFF)||(v_m==0xFF)||(v_d==0xFF)||(v_s==0xFF))
-	return 0;
-    sprintf(buf, "%02d%02d%02d%02d", v_y, v_m, v_d, v_s);
-    return atoi(buf);
-}
+	int expected = elan_image_expected_checksum(page_count);
+	int image_module = elan_get_fw_module_id();
+	int image_iap = elan_get_fw_iap_ver();
+	int device_module = elan_get_module_id();
+	int device_iap = elan_get_version(1);
+	int device_checksum = elan_get_checksum(1);
 
-static int elan_restart_driver_ic()
-{
-    if(elan_write_cmd(0x0321, 0x0601)) {
-	usleep(20 * 1000);
-	return elan_write_cmd(0x0321, 0x0601);	
-    }
-    return 0;
+	if ((expected < 0) || (image_module != device_module) ||
+	    (image_iap != device_iap) || (expected != device_checksum))
+		return 0;
+	printf("Skip update: device already runs this image "
+	       "(module %x, IAP version %x, checksum %04x)\n",
+		device_module, device_iap, device_checksum);
+	return 1;
 }
 
-static int elan_write_info_eeprom_checksum(unsigned short checksum)
+static int elan_skip_eeprom_update(int size)
 {
-	
-    if(elan_write_cmd(0x0322, 0x4600)) {
-	usleep(20 * 1000);
-	if(elan_write_cmd(0x0322, 0x4600)) {
-		return -1;
+	elan_use_hid_i2c();
+	if (elan_get_eeprom_enable() <= 0)
+		return 0;
+	if (only_newer >= 0) {
+		int version = elan_read_eeprom_version();
+		if (version >= only_newer) {
+			printf("Skip update: EEPROM version %x is not older than %x\n",
+				version, only_newer);
+			return 1;
+		}
 	}
-    }
-    elan_read_cmd(0x0322);
-    int ret = le_bytes_to_int(rx_buf);
-    if((ret & 0xFFFF)!=0x4600)
-    	return -2;
+	if (!skip_identical)
+		return 0;
 
-    if(elan_set_password() < 0) {
-	if(elan_set_password() < 0)
-		return -6;
-    }
-    if(elan_write_cmd(0x0311, 0x1EA5)) {
-	usleep(20 * 1000);
-	if(elan_write_cmd(0x0311, 0x1EA5)) 
-		return -3;
-    }
-    if(elan_write_cmd(0x048b, checksum)) {
-	usleep(20 * 1000);
-	if(elan_write_cmd(0x048b, checksum)) 
-		return -4;
+	int expected = elan_eeprom_expected_checksum(size, ETP_EEPROM_PAGE_SIZE);
+	int device_checksum = elan_read_eeprom_checksum_process();
 
-    }
-    if(elan_write_cmd(0x0322, 0x0000)) {
-	usleep(20 * 1000);
-	if(elan_write_cmd(0x0322, 0x0000)) 
-		return -5;
+	if (device_checksum != expected)
+		return 0;
+	printf("Skip update: EEPROM already holds this image (checksum %04x)\n",
+		device_checksum);
+	return 1;
+}
 
-    }
-    elan_read_cmd(0x048b);
-    ret = le_bytes_to_int(rx_buf);
-    if((ret & 0xFFFF)!=checksum)
-    	 return -6;
-  
-    return 1;
+static int elan_skip_update(int state, int size)
+{
+	if (!skip_identical && (only_newer < 0))
+		return 0;
+	if (state == EEPROM_IAP_STATE)
+		return elan_skip_eeprom_update(size);
+	return elan_skip_main_update();
+}
+
+/*
+ * Delta flashing.
+ *
+ * IAP frames carry no address: the part takes pages in order from the
+ * IAP start address, so only a trailing run of unchanged pages can be
+ * left out.  The manifest written after the last good update records a
+ * hash of every page; it is only trusted while the IAP checksum read
+ * back still matches it, and a partial write is always checked against
+ * the checksum of the whole image with a full write as the fallback.
+ */
+#define MANIFEST_MAGIC			"etphid-manifest 1"
 
+static int elan_manifest_page_count(void)
+{
+	return (fw_size - elan_get_iap_addr() + fw_page_size - 1) / fw_page_size;
 }
 
-static int elan_get_eeprom_iap_ctrl(void)
+static uint64_t elan_manifest_page_hash(int page)
 {
-    elan_read_cmd(0x0321);
-    int ret = le_bytes_to_int(rx_buf);
-    if((ret & 0x800)!=0x800)
-    {
-        printf("Error bit11 fail %x\n", ret);
-        return -1;
-    }
-    if((ret & 0x1000)==0x1000)
-    {
-        printf("Error bit12 fail Resend %x\n", ret);      
-        return 0;
-    }
-    return 1;
+	int offset = elan_get_iap_addr() + page * fw_page_size;
+	int len = fw_size - offset;
 
+	if (len > fw_page_size)
+		len = fw_page_size;
+	return elan_page_hash(fw_data + offset, len);
 }
 
-static int elan_eeprom_prepare_for_update()
+static void elan_manifest_path(char *path, size_t size)
 {
+	snprintf(path, size, "%s/manifest-%04x", manifest_dir, module_id & 0xFFFF);
+}
 
-    int ret = elan_get_eeprom_enable();
-    if(ret <= 0)
-    {
-	printf("EEPROM is not Enable.(%x) !!\n", ret);
-        return -2;
-    }
-  
-    ret = elan_read_eeprom_version();
-    if(ret < -1)
-    {
-	printf("Read EEPROM Version FAIL  (%d) !!\n", ret);
-        return -1;
-    }
-    if((eeprom_driver_ic!=2)||(eeprom_iap_version!=1))
-    {
-	printf("Can't support this EEPROM IAP (%x,%x) !!\n", eeprom_driver_ic, eeprom_iap_version);
-        return -3;
-    }
-
-    elan_get_iap_fw_page_size();
+/* Returns the first byte the delta write does not need to send */
+static int elan_delta_write_end(void)
+{
+	char path[PATH_MAX];
+	char magic[32];
+	unsigned int module, checksum, iap_addr;
+	int page_size, pages, i, last = -1;
+	unsigned long long hash;
+	FILE *f;
+
+	elan_manifest_path(path, sizeof(path));
+	f = fopen(path, "r");
+	if (!f) {
+		printf("Delta: no manifest at %s, writing all pages\n", path);
+		return fw_size;
+	}
+	if ((fscanf(f, "%31[^\n]\n", magic) != 1) ||
+	    strcmp(magic, MANIFEST_MAGIC) ||
+	    (fscanf(f, "module %x\niap_checksum %x\npage_size %d\n"
+		       "iap_addr %x\npages %d\n",
+		    &module, &checksum, &page_size, &iap_addr, &pages) != 5)) {
+		fclose(f);
+		printf("Delta: unreadable manifest %s, writing all pages\n", path);
+		return fw_size;
+	}
+	if ((module != (unsigned int)(module_id & 0xFFFF)) ||
+	    ((int)checksum != device_iap_checksum) ||
+	    (page_size != fw_page_size) ||
+	    ((int)iap_addr != elan_get_iap_addr()) ||
+	    (pages != elan_manifest_page_count())) {
+		fclose(f);
+		printf("Delta: manifest does not describe this device "
+		       "(checksum %04x/%04x), writing all pages\n",
+			checksum, device_iap_checksum & 0xFFFF);
+		return fw_size;
+	}
+	for (i = 0; i < pages; i++) {
+		if (fscanf(f, "%llx\n", &hash) != 1) {
+			fclose(f);
+			printf("Delta: truncated manifest %s, writing all pages\n", path);
+			return fw_size;
+		}
+		if (hash != elan_manifest_page_hash(i))
+			last = i;
+	}
+	fclose(f);
 
-    for(int i=0; i<10; i++) {
-	    ret = elan_enable_long_transmmison_mode();
-	    if(ret < 0)
-	    {
-		printf("Long Transmmison mode FAIL  (%x) !!\n", ret);
-		return -4;
-	    }
-	    ret = elan_enable_eeprom_iap_mode();
-	    if(ret < 0)
-	    {
-		printf("Enable EEPROM IAP mode FAIL  (%x) !!\n", ret);
-		return -5;
-	    }
+	/* The part only leaves IAP mode through a write, so send at least one page */
+	if (last < 0)
+		last = 0;
+	return elan_get_iap_addr() + (last + 1) * fw_page_size;
+}
 
-	    elan_read_cmd(0x0321);
-	    ret = le_bytes_to_int(rx_buf);
-	    if((ret & 0x800)!=0x800)
-	    {
-                ret=0;
-		i=10;
-	    }
+static void elan_manifest_save(uint16_t checksum)
+{
+	char path[PATH_MAX], tmp[PATH_MAX + 8];
+	int pages = elan_manifest_page_count();
+	FILE *f;
+
+	mkdir(manifest_dir, 0755);
+	elan_manifest_path(path, sizeof(path));
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	f = fopen(tmp, "w");
+	if (!f) {
+		printf("Delta: cannot write manifest %s (%s)\n", tmp, strerror(errno));
+		return;
+	}
+	fprintf(f, "%s\nmodule %04x\niap_checksum %04x\npage_size %d\n"
+		   "iap_addr %04x\npages %d\n",
+		MANIFEST_MAGIC, module_id & 0xFFFF, checksum, fw_page_size,
+		elan_get_iap_addr(), pages);
+	for (int i = 0; i < pages; i++)
+		fprintf(f, "%016llx\n", (unsigned long long)elan_manifest_page_hash(i));
+	if ((fflush(f) != 0) || (fsync(fileno(f)) != 0)) {
+		fclose(f);
+		unlink(tmp);
+		printf("Delta: cannot write manifest %s (%s)\n", tmp, strerror(errno));
+		return;
+	}
+	fclose(f);
+	if (rename(tmp, path) < 0) {
+		unlink(tmp);
+		printf("Delta: cannot write manifest %s (%s)\n", path, strerror(errno));
+	}
+}
 
-    }
-    if(ret < 0)
-    {
-	printf("Can't Enter EEPROM IAP mode (%x) !!\n", ret);
-	return -6;
-    }
-    return 1;
+/*
+ * Continue an interrupted update if the journal describes this image and
+ * the part is still waiting in IAP mode.  Returns the address to resume
+ * from, or -1 to run the normal preparation and write every page.
+ */
+static int elan_journal_resume(void)
+{
+	struct elan_journal j;
+	int fd, ctrl;
 
+	if (!journal_path)
+		return -1;
+	fd = open(journal_path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	int len = pread(fd, &j, sizeof(j), 0);
+	close(fd);
+	if ((len != sizeof(j)) || memcmp(j.magic, JOURNAL_MAGIC, sizeof(j.magic)) ||
+	    (j.next_addr <= 0)) {
+		printf("Journal: %s is incomplete, ignoring it\n", journal_path);
+		return -1;
+	}
+	if ((j.image_hash != fw_image_hash) || (j.ic_type != ic_type)) {
+		printf("Journal: %s is for another image, ignoring it\n", journal_path);
+		return -1;
+	}
+	ctrl = elan_get_iap_ctrl();
+	if ((ctrl == 0xFFFF) || (ctrl == ETP_I2C_IAP_CTRL_CMD) ||
+	    (ctrl & ETP_I2C_MAIN_MODE_ON) || !(ctrl & ETP_FW_IAP_CHECK_PW)) {
+		printf("Journal: device is not waiting in IAP mode (%04x), "
+		       "starting over\n", ctrl);
+		return -1;
+	}
+	/* The boot code may not answer the module ID, the image carries it too */
+	int device_module = elan_get_module_id();
+	if ((device_module == 0xFFFF) || (device_module == ETP_GET_MODULE_ID_CMD))
+		device_module = elan_get_fw_module_id();
+	if ((device_module & 0xFFFF) != j.module_id) {
+		printf("Journal: %s is for module %x, not %x, removed it\n",
+			journal_path, j.module_id, device_module & 0xFFFF);
+		unlink(journal_path);
+		return -1;
+	}
 
+	/* Same geometry and flimforce layout as the interrupted run */
+	module_id = j.module_id;
+	fw_page_size = j.page_size;
+	fw_section_size = j.section_size;
+	fw_no_of_sections = fw_page_size / fw_section_size;
+	if (j.flimforce_addr > 0) {
+		fw_flimforce_addr = elan_get_fw_flimforce_addr();
+		flimforce_addr = j.flimforce_addr;
+		elan_layout_flimforce_area();
+	}
+	int iap_addr = elan_get_iap_addr();
+	if ((fw_size != j.image_size) || (iap_addr != j.iap_addr) ||
+	    (j.next_addr < iap_addr) || ((j.next_addr - iap_addr) % fw_page_size) ||
+	    (j.next_addr >= fw_size) ||
+	    (elan_calc_checksum(fw_data + iap_addr, j.next_addr - iap_addr) != j.checksum) ||
+	    (fw_flimforce_area_checksum != j.flimforce_checksum)) {
+		unlink(journal_path);
+		elan_reset_tp();
+		switch_to_ptpmode();
+		request_exit("Journal %s does not match the image, removed it. "
+			     "Run the update again.\n", journal_path);
+	}
+	journal = j;
+	elan_build_flash_plan();
+	printf("Journal: resuming at page %d of %d\n",
+		(j.next_addr - iap_addr) / fw_page_size, elan_manifest_page_count());
+	return j.next_addr;
 }
 
-static int i2c_write_eeprom_fw_block(int index, unsigned char *raw_data, unsigned short checksum, int eeprom_page_size)
+static uint16_t elan_flash_firmware(int start)
 {
+	int iap_addr = elan_get_iap_addr();
+	int pages = elan_manifest_page_count();
+	int end = fw_size;
+	uint16_t local_checksum, remote_checksum;
+
+	if ((start == iap_addr) && manifest_dir)
+		end = elan_delta_write_end();
+	if (start == iap_addr)
+		elan_journal_begin();
+	else
+		journal_fd = open(journal_path, O_WRONLY);
 
+	elan_stats_phase(PHASE_FLASH);
+	uint64_t start_us = elan_get_time_us();
+	local_checksum = elan_update_firmware(start, end);
+	uint64_t write_us = elan_get_time_us() - start_us;
+	elan_stats_phase(PHASE_VERIFY);
 
-    unsigned char page_store[fw_page_size*2 + 11];
-    memset(page_store, 0 , sizeof(page_store));
-    
-    int rv;
-    page_store[0]  = 0x05;
-    page_store[1]  = 0x00;
-    page_store[2]  = 0x3b;
-    page_store[3]  = 0x03;
-    page_store[4]  = 0x06;
-    page_store[5]  = 0x00;
-    page_store[6]  = fw_page_size*2 + 5;
-    page_store[7]  = 0x00;
-    page_store[8]  = 0x0B;
-    page_store[9]  = eeprom_page_size+5;
-    page_store[10] = 0xA2;
-    page_store[11] = (index / 256);
-    page_store[12] = (index % 256);
-    memcpy(page_store + 13, raw_data, eeprom_page_size);
-    page_store[eeprom_page_size + 13 + 0] = (checksum >> 8) & 0xff;
-    page_store[eeprom_page_size + 13 + 1] = (checksum >> 0) & 0xff;
-
-    rv = i2c_send_cmd(page_store, sizeof(page_store), NULL, 0);
-
-    if (rv)
-    	return rv;
+	/* A partial write does not end IAP on its own */
+	if (end < fw_size)
+		elan_reset_tp();
+	/* Wait for a reset */
+	elan_wait_ready(READY_FLASH, 1200 * 1000);
+	elan_end_burst();
+	remote_checksum = elan_get_checksum(1);
+
+	if ((remote_checksum != local_checksum) && ((start > iap_addr) || (end < fw_size))) {
+		printf("%s: checksum %04x after partial write, expected %04x, "
+		       "rewriting all pages\n", (start > iap_addr) ? "Journal" : "Delta",
+			remote_checksum, local_checksum);
+		elan_stats_phase(PHASE_PREPARE);
+		elan_reset_tp();
+		elan_wait_ready(READY_RESET, 30 * 1000);
+		if (elan_set_password() < 0) {
+			switch_to_ptpmode();
+			request_exit("Unable to set Password FAIL.\n");
+		}
+		elan_enter_iap();
+		elan_journal_begin();
+		elan_stats_phase(PHASE_FLASH);
+		local_checksum = elan_update_firmware(iap_addr, fw_size);
+		elan_stats_phase(PHASE_VERIFY);
+		elan_wait_ready(READY_FLASH, 1200 * 1000);
+		elan_end_burst();
+		remote_checksum = elan_get_checksum(1);
+	} else if (end < fw_size) {
+		int written = (end - iap_addr) / fw_page_size;
 
-    if(fw_page_size == 512)
-	usleep(50 *1000);
-    else
-	usleep(35 * 1000);
+		printf("Delta: wrote %d of %d pages, skipped %d, saved ~%llu ms\n",
+			written, pages, pages - written,
+			(unsigned long long)(write_us / written * (pages - written) / 1000));
+	}
+	elan_journal_finish();
+
+	if (remote_checksum != local_checksum)
+		printf("checksum diff local=[%04X], remote=[%04X]\n",
+				local_checksum, remote_checksum);
+	else if (manifest_dir)
+		elan_manifest_save(remote_checksum);
+	return remote_checksum;
+}
 
-    int ret = elan_set_eeprom_datatype();
-    if(ret < 0)
-    {
-	printf("Set EEPROM DataType FAIL  (%x) !!\n", ret);
-        return -1;
-    }
+/*
+ * Offline image inspection.  Images are parsed without a device and
+ * reported as one JSON object per line.  A directory is walked for *.bin
+ * files, which are handed out to one worker per core; results land in
+ * shared slots and are printed in path order once the workers are done.
+ */
+#define INSPECT_SLOT_SIZE		8192
 
-    ret=elan_get_eeprom_iap_ctrl();
-    if(ret==0)
-    {
-	printf("EEPROM IAP reports failed write %d\n", ret);
-        return -1;
-    }
-    else if(ret==-1)
-	return -2;
-    
-    return 0;
-}
-static int hid_write_eeprom_fw_block(int index, unsigned char *raw_data, unsigned short checksum, int eeprom_page_size)
+static void inspect_printf(char **p, size_t *left, const char *format, ...)
 {
+	va_list ap;
+	int n;
 
-    unsigned char page_store[fw_page_size*2 + 3];
-    memset(page_store, 0 , sizeof(page_store));
+	va_start(ap, format);
+	n = vsnprintf(*p, *left, format, ap);
+	va_end(ap);
+	if (n < 0)
+		return;
+	if ((size_t)n >= *left)
+		n = *left ? *left - 1 : 0;
+	*p += n;
+	*left -= n;
+}
 
-    int rv;
-    page_store[0] = 0x0B;
-    page_store[1] = eeprom_page_size + 5;
-    page_store[2] = 0xA2;
-    page_store[3] = (index / 256);
-    page_store[4] = (index % 256);
-    memcpy(page_store + 5, raw_data,(eeprom_page_size));
-    page_store[eeprom_page_size + 5 + 0] = (checksum >> 8) & 0xff;
-    page_store[eeprom_page_size + 5 + 1] = (checksum >> 0) & 0xff;
+static void inspect_string(char **p, size_t *left, const char *str)
+{
+	inspect_printf(p, left, "\"");
+	for (; *str; str++) {
+		unsigned char c = *str;
+		if ((c == '"') || (c == '\\'))
+			inspect_printf(p, left, "\\%c", c);
+		else if (c < 0x20)
+			inspect_printf(p, left, "\\u%04x", c);
+		else
+			inspect_printf(p, left, "%c", c);
+	}
+	inspect_printf(p, left, "\"");
+}
 
-    rv = hid_send_cmd(page_store, sizeof(page_store), NULL, 0);
+static void inspect_hex(char **p, size_t *left, const char *key, int val)
+{
+	if (val < 0)
+		inspect_printf(p, left, ",\"%s\":null", key);
+	else
+		inspect_printf(p, left, ",\"%s\":\"0x%04x\"", key, val);
+}
 
-    if (rv)
-    	return rv;
+/* Returns 0 if the image has a valid signature for some IC, 1 otherwise */
+static int elan_inspect_image(const char *path, char *out, size_t size)
+{
+	char *p = out;
+	size_t left = size;
+	int valid = 0;
 
-    if(fw_page_size == 512)
-	usleep(50 *1000);
-    else
-	usleep(35 * 1000);
+	inspect_printf(&p, &left, "{\"path\":");
+	inspect_string(&p, &left, path);
 
-    int ret = elan_set_eeprom_datatype();
-    if(ret < 0)
-    {
-        printf("Set EEPROM DataType FAIL  (%x) !!\n", ret);
-        return -1;
-    }
+	switch (elan_try_map_image(path)) {
+	case -1:
+		inspect_printf(&p, &left, ",\"valid\":false,\"error\":\"cannot open: %s\"}",
+			strerror(errno));
+		return 1;
+	case -2:
+		inspect_printf(&p, &left, ",\"valid\":false,\"error\":\"size %d is outside 1..%d\"}",
+			fw_image_size, MAX_FW_SIZE);
+		return 1;
+	case -3:
+		inspect_printf(&p, &left, ",\"valid\":false,\"error\":\"cannot map: %s\"}",
+			strerror(errno));
+		return 1;
+	case -4:
+		inspect_printf(&p, &left, ",\"valid\":false,\"error\":\"damaged gzip: %s\"}",
+			inflate_error);
+		return 1;
+	}
 
-    ret=elan_get_eeprom_iap_ctrl();
-    if(ret==0)
-    {
-        printf("EEPROM IAP reports failed write %d\n", ret);
-        return -1;
-    }
-    else if(ret==-1)
-    	return -2;
+	int iap_addr = elan_get_iap_addr();
+	iap_version = elan_get_fw_iap_ver();
+	int flim = elan_get_fw_flimforce_addr();
+
+	inspect_printf(&p, &left, ",\"size\":%d", fw_image_size);
+	inspect_hex(&p, &left, "iap_addr", iap_addr);
+	inspect_hex(&p, &left, "iap_version", iap_version);
+	inspect_hex(&p, &left, "module_id", elan_get_fw_module_id());
+	inspect_hex(&p, &left, "flimforce_addr", flim);
+	inspect_hex(&p, &left, "checksum", elan_calc_checksum(fw_data, fw_image_size & ~1));
+	if ((flim > FW_SIGNATURE_SIZE) && (flim <= fw_image_size))
+		inspect_printf(&p, &left, ",\"flimforce_signature\":%s",
+			elan_image_signature_ok(flim - FW_SIGNATURE_SIZE) ? "true" : "false");
+
+	if ((iap_addr <= 0) || (iap_addr >= fw_image_size)) {
+		inspect_printf(&p, &left, ",\"valid\":false,\"error\":\"invalid IAP start address\"}");
+		elan_unmap_image();
+		return 1;
+	}
 
-    return 0;
+	/* One entry per distinct page count, smallest first */
+	inspect_printf(&p, &left, ",\"page_counts\":[");
+	for (int pages = 0, first = 1; ; first = 0) {
+		int next = INT_MAX;
+		for (int t = 0; t < 0x100; t++) {
+			int n = elan_ic_type_page_count(t);
+			if ((n > pages) && (n < next))
+				next = n;
+		}
+		if (next == INT_MAX)
+			break;
+		pages = next;
+
+		int end = pages * FW_PAGE_SIZE;
+		int fits = (end == fw_image_size);
+		int sig = (end <= fw_image_size) &&
+			  elan_image_signature_ok(end - FW_SIGNATURE_SIZE);
+
+		inspect_printf(&p, &left, "%s{\"pages\":%d,\"ic_types\":[", first ? "" : ",", pages);
+		for (int t = 0, n = 0; t < 0x100; t++)
+			if (elan_ic_type_page_count(t) == pages)
+				inspect_printf(&p, &left, "%s\"0x%02x\"", n++ ? "," : "", t);
+		inspect_printf(&p, &left, "],\"size_match\":%s,\"signature\":%s",
+			fits ? "true" : "false", sig ? "true" : "false");
+		inspect_hex(&p, &left, "iap_checksum", (end <= fw_image_size) ?
+			elan_calc_checksum(fw_data + iap_addr, end - iap_addr) : -1);
+		inspect_printf(&p, &left, "}");
+		if (fits && sig)
+			valid = 1;
+	}
+	inspect_printf(&p, &left, "],\"valid\":%s}", valid ? "true" : "false");
+	elan_unmap_image();
+	return !valid;
 }
-static int hid_write_fw_block(uint8_t *raw_data, uint16_t checksum)
-{
-	uint8_t page_store[fw_section_size + 3];
-	int rv;
-	page_store[0] = 0x0B;   //Report ID
-    	memcpy(page_store + 1, raw_data, fw_section_size);
-    	page_store[fw_section_size + 1 + 0] = (checksum >> 0) & 0xff;
-    	page_store[fw_section_size + 1 + 1] = (checksum >> 8) & 0xff;
-	
-	rv = hid_send_cmd(
-			page_store, sizeof(page_store), 0, 0);
-	if (rv)
-		return rv;
 
-	if((fw_section_size == fw_page_size) || (fw_section_cnt == fw_no_of_sections))
-	{
-		if(fw_page_size == 512)
-			usleep(50 *1000);
-	    	else
-			usleep(35 * 1000);
+struct inspect_list {
+	char **paths;
+	int count;
+	int size;
+};
 
-		elan_read_cmd(ETP_I2C_IAP_CTRL_CMD);
-		rv = le_bytes_to_int(rx_buf);
-		//printf("rv - %d %x\n", rv,rv);	
-		fw_section_cnt = 0;
-		if (rv & (ETP_FW_IAP_PAGE_ERR | ETP_FW_IAP_INTF_ERR)) {
-			printf("IAP reports failed write : %x\n", rv);
-			fw_section_cnt++;
-			return rv;
+static void inspect_collect(const char *dir, struct inspect_list *list)
+{
+	DIR *d = opendir(dir);
+	struct dirent *ent;
+	struct stat st;
+
+	if (!d)
+		return;
+	while ((ent = readdir(d))) {
+		if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+			continue;
+
+		size_t len = strlen(dir) + strlen(ent->d_name) + 2;
+		char *path = malloc(len);
+		if (!path)
+			request_exit("Out of memory\n");
+		snprintf(path, len, "%s/%s", dir, ent->d_name);
+		if (lstat(path, &st) < 0) {
+			free(path);
+			continue;
 		}
-		
+		if (S_ISDIR(st.st_mode)) {
+			inspect_collect(path, list);
+			free(path);
+			continue;
+		}
+		size_t n = strlen(ent->d_name);
+		if (!S_ISREG(st.st_mode) || (n < 4) ||
+		    (strcasecmp(ent->d_name + n - 4, ".bin") &&
+		     ((n < 7) || strcasecmp(ent->d_name + n - 7, ".bin.gz")))) {
+			free(path);
+			continue;
+		}
+		if (list->count == list->size) {
+			list->size = list->size ? list->size * 2 : 256;
+			list->paths = realloc(list->paths, list->size * sizeof(char *));
+			if (!list->paths)
+				request_exit("Out of memory\n");
+		}
+		list->paths[list->count++] = path;
 	}
-	fw_section_cnt++;
-	return 0;
+	closedir(d);
 }
 
-static int _elan_write_fw_block(uint8_t *raw_data, uint16_t checksum)
+static int inspect_compare(const void *a, const void *b)
 {
-	if (interface_type==HID_INTERFACE)
-		return hid_write_fw_block(raw_data, checksum);
-	else
-		return i2c_write_fw_block(raw_data, checksum);
+	return strcmp(*(char *const *)a, *(char *const *)b);
 }
 
-static int elan_write_fw_block(uint8_t *raw_data, uint16_t checksum)
-{	
-	int rv;
-	for(int i=0; i<10 ; i++) {
-		rv = _elan_write_fw_block(raw_data, checksum);
-		if(rv==0)
-			return 0;
-		printf("Retry(%d)..\n", i);
-		usleep(50);
+static void inspect_worker(struct inspect_list *list, int *next, int *status, char *slots)
+{
+	for (;;) {
+		int i = __atomic_fetch_add(next, 1, __ATOMIC_RELAXED);
+		if (i >= list->count)
+			break;
+		status[i] = elan_inspect_image(list->paths[i],
+			slots + (size_t)i * INSPECT_SLOT_SIZE, INSPECT_SLOT_SIZE);
 	}
-	return rv;
 }
 
-static uint16_t elan_update_firmware(void)
+static int elan_inspect_dir(const char *dir)
 {
-	uint16_t checksum = 0, block_checksum;
-	int rv, i;
-
-	fw_section_cnt = 1;
-	for (i = elan_get_iap_addr(); i < fw_size; i += fw_section_size) {
-		block_checksum = elan_calc_checksum(fw_data + i, fw_section_size);
-		rv = elan_write_fw_block(fw_data + i, block_checksum);
-		checksum += block_checksum;
-		printf("\rPage %3d is updated, checksum: %d, section: %d",
-			i / fw_page_size, checksum, fw_section_cnt);
-		fflush(stdout);
-		if (rv)
-			request_exit("Failed to update.");
+	struct inspect_list list = { NULL, 0, 0 };
+	uint64_t start = elan_get_time_us();
+	int workers = sysconf(_SC_NPROCESSORS_ONLN);
+	int invalid = 0, forked = 0;
+
+	elan_select_checksum_kernels();
+	inspect_collect(dir, &list);
+	qsort(list.paths, list.count, sizeof(char *), inspect_compare);
+	if (list.count == 0) {
+		fprintf(stderr, "No *.bin images under %s\n", dir);
+		return 1;
 	}
-	
-	// For ic_type 0x12 0x13, claculate all checksum.
-	if(fw_size_all>0) {
-		checksum += fw_flimforce_area_checksum;
+	if (workers > list.count)
+		workers = list.count;
+	if (workers < 1)
+		workers = 1;
+
+	/* Work counter, per-image status and output slots, shared with the workers */
+	size_t len = sizeof(int) * (list.count + 1) + (size_t)list.count * INSPECT_SLOT_SIZE;
+	int *shared = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (shared == MAP_FAILED)
+		request_exit("Cannot map inspector results (%s)\n", strerror(errno));
+	int *next = shared;
+	int *status = shared + 1;
+	char *slots = (char *)(status + list.count);
+
+	for (int i = 0; i < list.count; i++)
+		status[i] = -1;
+	fflush(stdout);
+	for (int w = 0; w < workers; w++) {
+		pid_t pid = fork();
+		if (pid == 0) {
+			inspect_worker(&list, next, status, slots);
+			_exit(0);
+		}
+		if (pid > 0)
+			forked++;
 	}
-	return checksum;
+	if (!forked)
+		inspect_worker(&list, next, status, slots);
+	while (wait(NULL) > 0)
+		;
+
+	for (int i = 0; i < list.count; i++) {
+		if (status[i] < 0) {
+			/* The worker died on this image */
+			char *p = slots + (size_t)i * INSPECT_SLOT_SIZE;
+			size_t left = INSPECT_SLOT_SIZE;
+			inspect_printf(&p, &left, "{\"path\":");
+			inspect_string(&p, &left, list.paths[i]);
+			inspect_printf(&p, &left, ",\"valid\":false,\"error\":\"inspection failed\"}");
+		}
+		printf("%s\n", slots + (size_t)i * INSPECT_SLOT_SIZE);
+		invalid += (status[i] != 0);
+		free(list.paths[i]);
+	}
+	fprintf(stderr, "Inspected %d images (%d invalid) with %d workers, %s checksums, in %llu ms\n",
+		list.count, invalid, forked ? forked : 1, elan_checksum_kernel,
+		(unsigned long long)(elan_get_time_us() - start) / 1000);
+	munmap(shared, len);
+	free(list.paths);
+	return invalid ? 1 : 0;
 }
-int finish_update_fw()
+
+static int elan_inspect(const char *path)
 {
-    int ret = elan_disable_long_transmmison_mode();
-    if(ret < 0)
-    {
-	printf("Disable Long Transmmison mode FAIL  (%x) !!\n", ret);
-        ret = -30;
-    }
-    ret = elan_disable_eeprom_iap_mode();
-    if(ret < 0)
-    {
-        printf("Disable EEPROM IAP mode FAIL  (%x) !!\n", ret);
-        ret = -31;	
-    }
-    return ret;
+	static char out[INSPECT_SLOT_SIZE];
+	struct stat st;
+
+	if ((stat(path, &st) == 0) && S_ISDIR(st.st_mode))
+		return elan_inspect_dir(path);
+	int rv = elan_inspect_image(path, out, sizeof(out));
+	printf("%s\n", out);
+	return rv;
 }
 
-int eeprom_write_page(int index,  unsigned short *checksum, int page_size)
+/*
+ * Firmware bundles.  One file carries the images for several models:
+ *
+ *	header		"ETPBNDL1", entry count, entry size
+ *	index		one entry per image, sorted by (module ID, IAP
+ *			version, IC type)
+ *	images		back to back, raw
+ *
+ * An IC type of 0 matches any part.  The bundle is mapped, the index is
+ * searched for the identity the part reports, first with its IC type and
+ * then with 0, and only the image found is checked and copied into the
+ * image reservation.  --pack-bundle builds a bundle from a directory of
+ * images; the IC type comes from an "_icXX" token in the file name.
+ */
+#define BUNDLE_MAGIC			"ETPBNDL1"
+
+struct elan_bundle_header {
+	char magic[8];
+	uint32_t count;
+	uint32_t entry_size;
+};
+
+struct elan_bundle_entry {
+	uint16_t module_id;
+	uint16_t iap_version;
+	uint16_t ic_type;		/* 0: any */
+	uint16_t iap_checksum;		/* what -I reads once the image is on the part */
+	uint32_t offset;		/* from the start of the bundle */
+	uint32_t size;
+	uint32_t crc32;
+	char name[44];
+};
+
+static const uint8_t *bundle_base;
+static size_t bundle_size;
+static const char *bundle_path;
+
+static int bundle_key_compare(const struct elan_bundle_entry *e, int module, int iap, int ic)
 {
-    unsigned short block_checksum;
-    int rv;
-    int error_count=0;
-    uint8_t *fw_data2 = fw_data;
-    uint8_t buffer[page_size];	
-    
-    if(index<0) {
-	index = 0;
-	memset(buffer, 0xFF , sizeof(buffer));
-	fw_data2 = buffer;	
-    }
-    block_checksum = elan_eeprom_calc_checksum(fw_data2 + index, page_size);
-    do
-    {
-	    if (interface_type==HID_INTERFACE)
-	       	rv = hid_write_eeprom_fw_block(index, fw_data2 + index, block_checksum, page_size);
-	    else
-		rv = i2c_write_eeprom_fw_block(index, fw_data2 + index, block_checksum, page_size);
+	if (e->module_id != module)
+		return (e->module_id < module) ? -1 : 1;
+	if (e->iap_version != iap)
+		return (e->iap_version < iap) ? -1 : 1;
+	if (e->ic_type != ic)
+		return (e->ic_type < ic) ? -1 : 1;
+	return 0;
+}
 
-	    fflush(stdout);
-	    if (rv==-1)
-	    {
-		error_count++;
-	       	if(error_count<10)
-		    	printf("\nRetry update page %d,  count = %d\n", index /page_size, error_count);
-	       	else
-	      		return -1;
-	    }
-	    else if(rv==-2)
-		return -2;
-	    else
-	    {
-		*checksum += block_checksum;
-	      	printf("\rPage %3d is updated, block_checksum: %4x checksum: %4x",
-		        index / page_size,  block_checksum, *checksum);
+static int bundle_entry_compare(const void *a, const void *b)
+{
+	const struct elan_bundle_entry *e = b;
+
+	return -bundle_key_compare(e, ((const struct elan_bundle_entry *)a)->module_id,
+				   ((const struct elan_bundle_entry *)a)->iap_version,
+				   ((const struct elan_bundle_entry *)a)->ic_type);
+}
+
+/* Returns 1 and keeps the bundle mapped if path is one, 0 otherwise */
+static int elan_bundle_open(const char *path)
+{
+	struct elan_bundle_header hdr;
+	struct stat st;
+	int fd = open(path, O_RDONLY);
+
+	if (fd < 0)
 		return 0;
-	    }
-    }while(1);
+	if ((fstat(fd, &st) < 0) || (st.st_size < (off_t)sizeof(hdr)) ||
+	    (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) ||
+	    memcmp(hdr.magic, BUNDLE_MAGIC, sizeof(hdr.magic))) {
+		close(fd);
+		return 0;
+	}
+	if ((hdr.count == 0) || (hdr.entry_size != sizeof(struct elan_bundle_entry)) ||
+	    (sizeof(hdr) + (uint64_t)hdr.count * hdr.entry_size > (uint64_t)st.st_size))
+		request_exit("Bundle %s has a damaged index\n", path);
+	bundle_base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (bundle_base == MAP_FAILED)
+		request_exit("Cannot map bundle: %s (%s)\n", path, strerror(errno));
+	bundle_size = st.st_size;
+	bundle_path = path;
+	return 1;
 }
 
+static const struct elan_bundle_entry *elan_bundle_find(int module, int iap, int ic)
+{
+	const struct elan_bundle_header *hdr = (const void *)bundle_base;
+	const struct elan_bundle_entry *index = (const void *)(hdr + 1);
+	int lo = 0, hi = hdr->count;
+
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+		int c = bundle_key_compare(&index[mid], module, iap, ic);
+
+		if (c == 0)
+			return &index[mid];
+		if (c < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return NULL;
+}
 
-static int elan_eeprom_update_firmware(void)
+/* Picks the image for the part that is open and makes it the image to flash */
+static void elan_bundle_select(void)
 {
-    int rv;
-    int ret_prepare=elan_eeprom_prepare_for_update();
-    unsigned short check_sum=0;
-    int eeprom_fw_page_size=32;
-    
-    usleep(100 * 1000);
-    if(ret_prepare<0)
-    {
-	printf("-2 .prepare update fw error.. : return %d\n",ret_prepare);
-		rv=-2;
-        	goto exit;  
-    }
-    
-    for(int i=0; i<fw_size+1; i+= eeprom_fw_page_size)
-    {
-	//clear first page
-	if(i==0) {
-		rv =  eeprom_write_page(-1, &check_sum, eeprom_fw_page_size);
-		check_sum=0;	
-	}	
-	// first page iap
-	else if(i>=fw_size)
-		rv =  eeprom_write_page(0, &check_sum, eeprom_fw_page_size);
-	else
-        	rv =  eeprom_write_page(i, &check_sum, eeprom_fw_page_size);
-	if (rv<0)
-	{
-		printf("Failed to update. (%d)\n", rv);
-		rv=-3;
-        	goto exit;    
+	const struct elan_bundle_entry *e;
+	long page = sysconf(_SC_PAGESIZE);
+
+	if (!identity_cached) {
+		is_new_pattern = elan_get_patten();
+		module_id = elan_get_module_id();
+		ic_type = elan_get_ic_type();
+		iap_version = elan_get_version(1);
+	}
+	e = elan_bundle_find(module_id, iap_version, ic_type & 0xFF);
+	if (!e)
+		e = elan_bundle_find(module_id, iap_version, 0);
+	if (!e) {
+		switch_to_ptpmode();
+		request_exit("Bundle %s has no image for module %x, IAP version %x, "
+			     "IC type %x\n", bundle_path, module_id, iap_version, ic_type & 0xFF);
+	}
+	if ((e->size == 0) || (e->size > MAX_FW_SIZE) ||
+	    ((uint64_t)e->offset + e->size > bundle_size) ||
+	    (elan_crc32(0, bundle_base + e->offset, e->size) != e->crc32)) {
+		switch_to_ptpmode();
+		request_exit("Bundle %s: image %.*s is damaged\n", bundle_path,
+			     (int)sizeof(e->name), e->name);
 	}
 
-    }
-    rv=finish_update_fw();
-    if(rv<0)
-    {
-	printf( "-4 .finish_update_fw error (%d)..\n", rv);
-        rv=-4;
-        goto exit;       	
-    }
+	fw_image_size = e->size;
+	fw_map_size = (fw_image_size + ETP_IMAGE_SLACK + page - 1) & ~(page - 1);
+	fw_data = mmap(NULL, fw_map_size, PROT_READ | PROT_WRITE,
+		       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (fw_data == MAP_FAILED)
+		request_exit("Cannot map image from bundle (%s)\n", strerror(errno));
+	memcpy(fw_data, bundle_base + e->offset, e->size);
+	mprotect(fw_data, fw_map_size, PROT_READ);
+	printf("Bundle: %.*s for module %x, IAP version %x, IC type %x "
+	       "(%u bytes, IAP checksum %04x)\n", (int)sizeof(e->name), e->name,
+		e->module_id, e->iap_version, ic_type & 0xFF, e->size, e->iap_checksum);
+	munmap((void *)bundle_base, bundle_size);
+	bundle_base = NULL;
+}
 
-    usleep(2 * 1000);
-    rv = elan_read_eeprom_checksum_process();
-    if (rv != check_sum) {
-	printf("Update FAIL: checksum diff local=[%04X], remote=[%04X]\n",
-		check_sum, rv);
-        goto exit;
-    }
-    for(int i=0; i<3; i++)
-    {
-    	rv = elan_write_info_eeprom_checksum(check_sum & 0xFFFF);
-	if(rv>0)
-		i=3;
-    }
-    if(rv<0)
-	printf("Update PASS. (0x%04x) ; Informatin area record fail (%d)\n", check_sum, rv);
-    else
-	printf("Update PASS. (0x%04x)\n", check_sum);
+/* IC type from an "_icXX" token in the file name, 0 (any) without one */
+static int bundle_name_ic_type(const char *name)
+{
+	const char *p = name;
+	char hex[3] = { 0 }, *e;
+
+	while ((p = strstr(p, "_ic")) != NULL) {
+		p += 3;
+		if (!isxdigit((unsigned char)p[0]) || !isxdigit((unsigned char)p[1]))
+			continue;
+		memcpy(hex, p, 2);
+		return (int)strtoul(hex, &e, 16);
+	}
+	return 0;
+}
+
+static int elan_pack_bundle(const char *out, const char *dir)
+{
+	struct inspect_list list = { NULL, 0, 0 };
+	struct elan_bundle_header hdr;
+	struct elan_bundle_entry *index;
+	int *source;
+	char tmp[PATH_MAX + 8];
+	uint32_t offset;
+	FILE *f;
+
+	inspect_collect(dir, &list);
+	qsort(list.paths, list.count, sizeof(char *), inspect_compare);
+	if (list.count == 0) {
+		fprintf(stderr, "No *.bin images under %s\n", dir);
+		return 1;
+	}
+	index = calloc(list.count, sizeof(*index));
+	source = malloc(list.count * sizeof(*source));
+	if (!index || !source)
+		request_exit("Out of memory\n");
+
+	for (int i = 0; i < list.count; i++) {
+		const char *name = strrchr(list.paths[i], '/');
+		int iap_addr;
+
+		name = name ? name + 1 : list.paths[i];
+		if (elan_try_map_image(list.paths[i]) < 0)
+			request_exit("Bundle: cannot load %s\n", list.paths[i]);
+		iap_addr = elan_get_iap_addr();
+		if ((iap_addr <= 0) || (iap_addr >= fw_image_size) ||
+		    (elan_get_fw_module_id() < 0) || (elan_get_fw_iap_ver() < 0))
+			request_exit("Bundle: %s is not an ELAN image\n", list.paths[i]);
+		index[i].module_id = elan_get_fw_module_id();
+		index[i].iap_version = elan_get_fw_iap_ver();
+		index[i].ic_type = bundle_name_ic_type(name);
+		index[i].iap_checksum = elan_calc_checksum(fw_data + iap_addr,
+							   fw_image_size - iap_addr);
+		index[i].size = fw_image_size;
+		index[i].crc32 = elan_crc32(0, fw_data, fw_image_size);
+		/* The offset field holds the source until the index is sorted */
+		index[i].offset = i;
+		snprintf(index[i].name, sizeof(index[i].name), "%s", name);
+		elan_unmap_image();
+	}
+	qsort(index, list.count, sizeof(*index), bundle_entry_compare);
+
+	offset = sizeof(hdr) + list.count * sizeof(*index);
+	for (int i = 0; i < list.count; i++) {
+		if ((i > 0) && !bundle_entry_compare(&index[i - 1], &index[i]))
+			request_exit("Bundle: %s and %s are both module %x, IAP version %x, "
+				     "IC type %x\n", index[i - 1].name, index[i].name,
+				     index[i].module_id, index[i].iap_version, index[i].ic_type);
+		source[i] = index[i].offset;
+		index[i].offset = offset;
+		offset += index[i].size;
+	}
 
-exit:
-    elan_restart_driver_ic();
-    elan_reset_tp();
-    
-    usleep(1500 * 1000);
-    return rv;
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, BUNDLE_MAGIC, sizeof(hdr.magic));
+	hdr.count = list.count;
+	hdr.entry_size = sizeof(*index);
+	snprintf(tmp, sizeof(tmp), "%s.tmp", out);
+	f = fopen(tmp, "wb");
+	if (!f || (fwrite(&hdr, sizeof(hdr), 1, f) != 1) ||
+	    (fwrite(index, sizeof(*index), list.count, f) != (size_t)list.count))
+		request_exit("Bundle: cannot write %s (%s)\n", tmp, strerror(errno));
+	for (int i = 0; i < list.count; i++) {
+		if ((elan_try_map_image(list.paths[source[i]]) < 0) ||
+		    (fwrite(fw_data, 1, fw_image_size, f) != (size_t)fw_image_size))
+			request_exit("Bundle: cannot copy %s\n", list.paths[source[i]]);
+		elan_unmap_image();
+		printf("%s: module %x, IAP version %x, IC type ", index[i].name,
+			index[i].module_id, index[i].iap_version);
+		if (index[i].ic_type)
+			printf("%x, %u bytes\n", index[i].ic_type, index[i].size);
+		else
+			printf("any, %u bytes\n", index[i].size);
+	}
+	if ((fclose(f) != 0) || (rename(tmp, out) < 0))
+		request_exit("Bundle: cannot write %s (%s)\n", out, strerror(errno));
+	printf("Bundle %s: %d images, %u bytes\n", out, list.count, offset);
+	free(index);
+	free(source);
+	return 0;
 }
+
 static void pretty_print_buffer(uint8_t *buf, int len)
 {
 	int i;
@@ -2138,8 +6243,7 @@ static int get_iap_checksum()
 static int get_eeprom_checksum()
 {
     init_elan_tp();
-    if (interface_type==I2C_INTERFACE)
-	interface_type=HID_I2C_INTERFACE;
+    elan_use_hid_i2c();
 
     int rv = elan_read_eeprom_checksum_process();
     if(rv<0)
@@ -2161,8 +6265,7 @@ static int set_region_code()
 		printf("%d\n", ret);
 		return ret;
 	}
-	if (interface_type==I2C_INTERFACE)
-		interface_type=HID_I2C_INTERFACE;
+	elan_use_hid_i2c();
 	disable_report();	
 	for (int i=0; i<3 ; i++) {
 		ret = elan_set_region_code (region_code);
@@ -2181,124 +6284,238 @@ static int set_region_code()
 			return ret;
 		}
 		ret = -10;
-		usleep (10 * 1000);
+		SLEEP(10 * 1000);
 	}
 	switch_to_ptpmode();
 	printf("%d\n", ret);
 	return ret;	
 }
+static int query_region_code()
+{
+	if (interface_type < 0)
+		return -2;
+	elan_use_hid_i2c();
+	return elan_get_region_code();
+}
+
 static int get_region_code()
 {
 	int ret = 0;
 	init_elan_tp();
-	if (interface_type < 0) {
-		ret = -2;
-		printf("%d\n", ret);
-		return ret;
-	}
-	if (interface_type==I2C_INTERFACE)
-		interface_type=HID_I2C_INTERFACE;
-
-	ret = elan_get_region_code();
+	ret = query_region_code();
 	printf("%d\n", ret);
 	return ret;	
 }
 
-static int get_eeprom_version()
+static int query_eeprom_version()
 {
-    init_elan_tp();
-    if (interface_type==I2C_INTERFACE)
-	interface_type=HID_I2C_INTERFACE;
+    elan_use_hid_i2c();
 
     int ret = elan_get_eeprom_enable();
     if(ret <= 0)
     {
 	//printf("EEPROM is not Enable.(%x) !!\n", ret);
-        printf("-2\n");
         return -2;
     }
 
     int rv=elan_read_eeprom_version();
     if(rv<0)
     {
-	    usleep(100 * 1000);
+	    SLEEP(100 * 1000);
 	    rv=elan_read_eeprom_version();
-	    if(rv<0) {
-    		printf("%d\n", rv);
+	    if(rv<0)
     		return rv;
-	    } 
     }
 
     if((eeprom_driver_ic!=2)||(eeprom_iap_version!=1))
     {
 	//printf("Can't support this EEPROM IAP (%x,%x) !!\n", eeprom_driver_ic, eeprom_iap_version);
-	printf("-3\n");
         return -3;
     }
+    return rv;
+}
+
+static int get_eeprom_version()
+{
+    init_elan_tp();
 
-    printf("%x\n", rv);
+    int rv = query_eeprom_version();
+    if(rv<0)
+	printf("%d\n", rv);
+    else
+	printf("%x\n", rv);
     return rv;
 }
 
-int main(int argc, char *argv[])
+/*
+ * Batch queries.  Every query option sets a bit; with more than one, or
+ * with --json, the device is found once, the reads are issued back to
+ * back and the answers are printed as a single JSON object.  Values are
+ * hex strings (the region a number); a failed read is null, and its
+ * negative code, the one the single query prints, goes into "errors".
+ * Reads that switch to the HID-over-I2C transport come last.  The object
+ * is built in a buffer while the helpers' own messages go to stderr, so
+ * nothing can land between two fields.
+ */
+#define QUERY_JSON_SIZE		512
+
+static void query_print(char **p, size_t *left, int *first, const char *key,
+			int val, int hex)
 {
-	uint16_t local_checksum;
-	uint16_t remote_checksum;
+	inspect_printf(p, left, "%s\"%s\":", *first ? "" : ",", key);
+	if (val < 0)
+		inspect_printf(p, left, "null");
+	else if (!hex)
+		inspect_printf(p, left, "%d", val);
+	else
+		inspect_printf(p, left, "\"0x%04x\"", val);
+	*first = 0;
+}
 
-	int state=parse_cmdline(argc, argv);
+static const struct {
+	const char *key;
+	int hex;
+} query_fields[] = {		/* in QUERY_* bit order */
+	{ "fw_version", 1 },
+	{ "module_id", 1 },
+	{ "hardware_id", 1 },
+	{ "fw_checksum", 1 },
+	{ "iap_checksum", 1 },
+	{ "eeprom_checksum", 1 },
+	{ "eeprom_version", 1 },
+	{ "region", 0 },
+};
+#define QUERY_FIELDS	(int)(sizeof(query_fields) / sizeof(query_fields[0]))
 
-	if(state==GET_FWVER_STATE)
-	{		
-		get_current_version();
-		return 0;
-	}
-	else if(state==GET_MODULEID_STATE)
-	{		
-		get_module_id();
-		return 0;
-	}
-	else if(state==GET_HWID_STATE)
-	{		
-		get_hardware_id();
-		return 0;
-	}	
-	else if(state==GET_SWVER_STATE)
-	{
-		printf("Version: %s.%s\n", VERSION, VERSION_SUB);
-		return 0;
-	}
-	else if(state==GET_FW_CHECKSUM_STATE)
-	{
-		get_fw_checksum();
-		return 0;
-	}
-	else if(state==GET_IAP_CHECKSUM_STATE)
-	{
-		get_iap_checksum();
-		return 0;
-	}
-	else if(state==GET_EEPROM_CHECKSUM_STATE)
-	{
-		get_eeprom_checksum();
-		return 0;
+/* Answers the daemon keeps until the part is updated */
+struct query_cache {
+	int known;
+	int value[QUERY_FIELDS];
+};
+
+static int elan_query_value(int bit)
+{
+	int val;
+
+	switch (bit) {
+	case QUERY_FWVER:
+		val = elan_get_version(0);
+		if ((val == ETP_I2C_FW_VERSION_CMD) || (val == 0xFFFF))
+			val = -1;
+		return val;
+	case QUERY_MODULEID:
+		return elan_get_module_id();
+	case QUERY_HWID:
+		return elan_get_hardware_id();
+	case QUERY_FW_CHECKSUM:
+		return elan_get_checksum(0);
+	case QUERY_IAP_CHECKSUM:
+		return elan_get_checksum(1);
+	case QUERY_EEPROM_VERSION:
+		return query_eeprom_version();
+	case QUERY_EEPROM_CHECKSUM:
+		elan_use_hid_i2c();
+		return elan_read_eeprom_checksum_process();
+	case QUERY_REGION:
+		return query_region_code();
 	}
-	else if(state==GET_EEPROM_VERSION_STATE)
-	{
-		get_eeprom_version();
-		return 0;
+	return -1;
+}
+
+/* Builds the JSON object for mask, with a newline, into out */
+static void elan_query_json(int mask, struct query_cache *cache, char *out,
+			    size_t size)
+{
+	/* The EEPROM reads go last, they switch plain I2C to HID framing */
+	static const int order[] = {
+		QUERY_FWVER, QUERY_MODULEID, QUERY_HWID, QUERY_FW_CHECKSUM,
+		QUERY_IAP_CHECKSUM, QUERY_EEPROM_VERSION, QUERY_EEPROM_CHECKSUM,
+		QUERY_REGION,
+	};
+	int val[QUERY_FIELDS];
+	int first = 1, i, n, type = interface_type, saved;
+	char *p = out;
+	size_t left = size;
+
+	fflush(stdout);
+	saved = dup(STDOUT_FILENO);
+	dup2(STDERR_FILENO, STDOUT_FILENO);
+	for (n = 0; n < QUERY_FIELDS; n++) {
+		if (!(mask & order[n]))
+			continue;
+		i = __builtin_ctz(order[n]);
+		if (cache && (cache->known & order[n])) {
+			val[i] = cache->value[i];
+		} else {
+			val[i] = elan_query_value(order[n]);
+			if (cache && (val[i] >= 0)) {
+				cache->value[i] = val[i];
+				cache->known |= order[n];
+			}
+		}
 	}
-	else if(state==SET_REGION_LAYOUT_STATE)
-	{
-		set_region_code();
-		return 0;
+	fflush(stdout);
+	dup2(saved, STDOUT_FILENO);
+	close(saved);
+	if (interface_type != type)
+		elan_set_interface(type);
+
+	inspect_printf(&p, &left, "{");
+	for (n = 0; n < QUERY_FIELDS; n++) {
+		if (!(mask & order[n]))
+			continue;
+		i = __builtin_ctz(order[n]);
+		query_print(&p, &left, &first, query_fields[i].key, val[i],
+			    query_fields[i].hex);
 	}
-	else if(state==GET_REGION_LAYOUT_STATE)
-	{
-		get_region_code();
-		return 0;
+	first = 1;
+	for (n = 0; n < QUERY_FIELDS; n++) {
+		i = __builtin_ctz(order[n]);
+		if (!(mask & order[n]) || (val[i] >= 0))
+			continue;
+		inspect_printf(&p, &left, "%s\"%s\":%d", first ? ",\"errors\":{" : ",",
+			       query_fields[i].key, val[i]);
+		first = 0;
 	}
+	inspect_printf(&p, &left, "%s}\n", first ? "" : "}");
+}
+
+static void elan_query_object(int mask, struct query_cache *cache)
+{
+	char json[QUERY_JSON_SIZE];
+
+	elan_query_json(mask, cache, json, sizeof(json));
+	fputs(json, stdout);
+}
 
+static int elan_query_batch(int mask)
+{
 	init_elan_tp();
+	elan_query_object(mask, NULL);
+	return 0;
+}
+
+/* Update the device with firmware_binary, main or EEPROM per state */
+static int elan_run_update(int state)
+{
+	/* Map the FW file, a bundle once the part says which image it takes */
+	elan_stats_phase(PHASE_LOAD);
+	int bundle = elan_bundle_open(firmware_binary);
+	if (!bundle)
+		elan_map_image(firmware_binary);
+
+	/* A daemon job finds the part already open */
+	if (interface_type < 0)
+		init_elan_tp();
+	if (bundle) {
+		if (state == EEPROM_IAP_STATE)
+			request_exit("Bundle %s: bundles hold main firmware images only\n",
+				firmware_binary);
+		elan_stats_phase(PHASE_LOAD);
+		elan_bundle_select();
+	}
+	int bin_fw_size = fw_image_size;
+	elan_stats_phase(PHASE_PREPARE);
 
 	if (interface_type==HID_INTERFACE)
 		printf("HID interface\n");
@@ -2310,21 +6527,24 @@ int main(int argc, char *argv[])
 	 * Judge IC type  and get page count first.
 	 * Then check the FW file.
 	 */
-	/* Read the FW file */
-	FILE *f = fopen(firmware_binary, "rb");
+	if (state != EEPROM_IAP_STATE) {
+		int ic_size = elan_get_ic_page_count() * FW_PAGE_SIZE;
+		int iap_addr = elan_get_iap_addr();
 
-	if (!f) {
-		switch_to_ptpmode();
-		request_exit("Cannot find binary: %s\n", firmware_binary);
+		if (bin_fw_size != ic_size) {
+			switch_to_ptpmode();
+			request_exit("Binary is %d bytes, the IC takes %d\n", bin_fw_size, ic_size);
+		}
+		if ((iap_addr <= 0) || (iap_addr >= bin_fw_size)) {
+			switch_to_ptpmode();
+			request_exit("Binary has an invalid IAP start address (%x)\n", iap_addr);
+		}
 	}
-	fseek (f , 0 , SEEK_END);
-    	int bin_fw_size= (int)(ftell (f));
-	rewind (f);
-
-	if (fread(fw_data, 1, bin_fw_size, f) != (unsigned int)bin_fw_size) {
-		switch_to_ptpmode();
-		request_exit("binary size mismatch, expect %d\n", bin_fw_size);
+	if (elan_skip_update(state, bin_fw_size)) {
+		close(dev_fd);
+		return 0;
 	}
+
 	/*
 	 * It is possible that you are not able to get firmware info. This
 	 * might due to an incomplete update last time
@@ -2334,8 +6554,9 @@ int main(int argc, char *argv[])
 	fw_page_count = elan_get_ic_page_count();
 
 	if (state==EEPROM_IAP_STATE) {
-		if (interface_type==I2C_INTERFACE)
-			interface_type=HID_I2C_INTERFACE;
+		if (plan_path)
+			fw_image_hash = elan_page_hash(fw_data, bin_fw_size);
+		elan_use_hid_i2c();
 		fw_size = bin_fw_size;
 		elan_eeprom_update_firmware();
 		
@@ -2361,24 +6582,458 @@ int main(int argc, char *argv[])
 			pretty_print_buffer(rx_buf, 637);
 		}
 
-		/* Get the trackpad ready for receiving update */
-		elan_prepare_for_update();
-
-		local_checksum = elan_update_firmware();
-		/* Wait for a reset */
-		usleep(1200 * 1000);
-		remote_checksum = elan_get_checksum(1);
-		if (remote_checksum != local_checksum)
-			printf("checksum diff local=[%04X], remote=[%04X]\n",
-					local_checksum, remote_checksum);
+		if (journal_path || plan_path)
+			fw_image_hash = elan_page_hash(fw_data, bin_fw_size);
+		int start = elan_journal_resume();
+		if (start < 0) {
+			/* Get the trackpad ready for receiving update */
+			elan_prepare_for_update();
+			start = elan_get_iap_addr();
+		}
+		elan_flash_firmware(start);
 		printf("\n");
 		/* Print the updated firmware information */
+		elan_stats_phase(PHASE_RESET);
 		elan_reset_tp();
-	    	usleep(300);
+	    	SLEEP(300);
 		elan_get_fw_info();
 	}
 	switch_to_ptpmode();
+	if (poll_mode)
+		elan_print_ready();
+	if (extended_i2c_exercise)
+		elan_print_transport_stats();
 
 	close(dev_fd);
 	return 0;
 }
+
+/*
+ * Benchmark.  Every IC type the updater knows gets a main flash and an
+ * EEPROM update against the simulator, whose latencies come from --sim.
+ * Each job runs in its own child so a failing one does not stop the rest.
+ * Jobs run one after the other unless --bench-jobs lets several overlap,
+ * which is quicker but makes the wall and CPU figures depend on the
+ * siblings and the host load.  Results are printed as one JSON line per
+ * job, in job order.
+ */
+#define BENCH_EEPROM_SIZE		(16 * 1024)
+#define BENCH_MAX_JOBS			64
+
+struct bench_result {
+	int iap_version;
+	int page_size;
+	int pages;
+	unsigned long transactions;
+	uint64_t wall_us;
+	uint64_t io_us;
+	uint64_t sleep_us;
+	uint64_t ready_us;
+};
+
+static int bench_iap_version(int ic)
+{
+	if (ic == 0x13)
+		return 5;		/* password protected IAP */
+	if ((ic == 0x12) || (ic == 0x14) || (ic == 0x15))
+		return 3;
+	return 2;
+}
+
+static int bench_write_eeprom_image(const char *path)
+{
+	static uint8_t image[BENCH_EEPROM_SIZE];
+	uint32_t seed = 0x45455052;
+	int fd, ret;
+
+	for (int i = 0; i < BENCH_EEPROM_SIZE; i++) {
+		seed = seed * 1103515245 + 12345;
+		image[i] = seed >> 16;
+	}
+	fd = open(path, O_WRONLY | O_TRUNC);
+	if (fd < 0)
+		return -1;
+	ret = (write(fd, image, sizeof(image)) == sizeof(image)) ? 0 : -1;
+	close(fd);
+	return ret;
+}
+
+static void bench_child(int ic, int eeprom, char *image, int out)
+{
+	struct bench_result r;
+	uint64_t start;
+	int fd = open("/dev/null", O_WRONLY);
+
+	dup2(fd, STDOUT_FILENO);
+	dup2(fd, STDERR_FILENO);
+	/* Jobs may overlap, so each records its own session to replay alone */
+	if (trace_path) {
+		char path[PATH_MAX];
+
+		snprintf(path, sizeof(path), "%s.%02x-%s", trace_path, ic,
+			 eeprom ? "eeprom" : "main");
+		close(trace_fd);
+		elan_trace_open(path);
+	}
+	sim.ic_type = ic;
+	sim.iap_version = bench_iap_version(ic);
+	sim.image_rev = 1;
+	sim_setup();
+	if (eeprom ? bench_write_eeprom_image(image) : sim_dump_image(image))
+		exit(2);
+	firmware_binary = image;
+	/* Sleep time is summed per call site */
+	stats_enabled = 1;
+
+	start = elan_get_time_us();
+	if (elan_run_update(eeprom ? EEPROM_IAP_STATE : IAP_STATE))
+		exit(1);
+	memset(&r, 0, sizeof(r));
+	r.wall_us = elan_get_time_us() - start;
+	r.iap_version = sim.iap_version;
+	if (eeprom) {
+		r.page_size = eeprom_payload ? eeprom_payload : ETP_EEPROM_PAGE_SIZE;
+		r.pages = plan.hdr.count;
+	} else {
+		r.page_size = fw_page_size;
+		r.pages = (fw_size - elan_get_iap_addr()) / fw_page_size;
+	}
+	r.transactions = sim_transport.transactions;
+	r.io_us = sim_transport.busy_us;
+	for (int i = 0; i < stats_site_count; i++)
+		r.sleep_us += stats_site[i].total_us;
+	for (int i = 0; i < READY_COUNT; i++)
+		r.ready_us += ready_stats[i].total_us;
+	fflush(stdout);
+	exit(write(out, &r, sizeof(r)) == sizeof(r) ? 0 : 3);
+}
+
+struct bench_job {
+	int ic;
+	int eeprom;
+	pid_t pid;
+	int fd;
+	char image[32];
+};
+
+static void bench_start(struct bench_job *job)
+{
+	int fd, p[2];
+
+	snprintf(job->image, sizeof(job->image), "/tmp/etphid-bench-XXXXXX");
+	fd = mkstemp(job->image);
+	if ((fd < 0) || (pipe(p) < 0))
+		request_exit("Bench: cannot set up a job (%s)\n", strerror(errno));
+	close(fd);
+	fflush(stdout);
+	/* The header goes out now, not after records of the children */
+	elan_trace_flush();
+	job->pid = fork();
+	if (job->pid == 0) {
+		close(p[0]);
+		bench_child(job->ic, job->eeprom, job->image, p[1]);
+	}
+	close(p[1]);
+	job->fd = p[0];
+}
+
+static int elan_bench(void)
+{
+	struct bench_job job[BENCH_MAX_JOBS];
+	struct bench_result r;
+	struct rusage ru;
+	int jobs = 0, started = 0, failed = 0, status;
+
+	for (int ic = 0; ic < 0x100; ic++) {
+		if (elan_ic_type_page_count(ic) < 0)
+			continue;
+		for (int eeprom = 0; (eeprom < 2) && (jobs < BENCH_MAX_JOBS); eeprom++) {
+			job[jobs].ic = ic;
+			job[jobs].eeprom = eeprom;
+			jobs++;
+		}
+	}
+
+	for (int i = 0; i < jobs; i++) {
+		/* Results are read in job order, so at most bench_jobs are running */
+		for (; (started < jobs) && (started < i + bench_jobs); started++)
+			bench_start(&job[started]);
+
+		int got = read(job[i].fd, &r, sizeof(r)) == sizeof(r);
+
+		close(job[i].fd);
+		memset(&ru, 0, sizeof(ru));
+		while ((job[i].pid > 0) && (wait4(job[i].pid, &status, 0, &ru) < 0) &&
+		       (errno == EINTR))
+			;
+		unlink(job[i].image);
+		printf("{\"ic\":\"0x%02x\",\"image\":\"%s\",", job[i].ic,
+			job[i].eeprom ? "eeprom" : "main");
+		if (!got || (job[i].pid < 0) || !WIFEXITED(status) || WEXITSTATUS(status)) {
+			printf("\"result\":\"failed\"}\n");
+			failed++;
+			continue;
+		}
+		double wall_s = r.wall_us / 1e6;
+		printf("\"iap_version\":%d,\"page_size\":%d,\"pages\":%d,"
+		       "\"wall_ms\":%.1f,\"pages_per_s\":%.1f,\"transactions\":%lu,"
+		       "\"tx_per_page\":%.2f,\"sleep_ms\":%.1f,\"ready_ms\":%.1f,\"io_ms\":%.1f,"
+		       "\"cpu_user_ms\":%.1f,\"cpu_sys_ms\":%.1f,"
+		       "\"page_latency_us\":%d,\"io_latency_us\":%d,\"poll\":%d,"
+		       "\"result\":\"ok\"}\n",
+			r.iap_version, r.page_size, r.pages, r.wall_us / 1000.0,
+			wall_s > 0 ? r.pages / wall_s : 0.0, r.transactions,
+			r.pages ? (double)r.transactions / r.pages : 0.0,
+			r.sleep_us / 1000.0, r.ready_us / 1000.0, r.io_us / 1000.0,
+			ru.ru_utime.tv_sec * 1000.0 + ru.ru_utime.tv_usec / 1000.0,
+			ru.ru_stime.tv_sec * 1000.0 + ru.ru_stime.tv_usec / 1000.0,
+			sim.page_latency_us, sim.io_latency_us, poll_mode);
+	}
+	return failed ? 1 : 0;
+}
+
+/*
+ * Daemon.  The device is found and locked once and requests arrive one
+ * line at a time on a Unix socket, one client after the other, so access
+ * is serialized.  Every response ends with a line starting "ok" or "err":
+ *
+ *	query [key ...]		ok {"fw_version":"0x000a",...}
+ *	update PATH		update log, then ok or err <exit code>
+ *	eeprom-update PATH	same for an EEPROM image
+ *	quit			ok, and the daemon exits
+ *
+ * Query answers are kept until an update, which runs in a child so a
+ * failing image cannot take the daemon down.  A client that sends or
+ * reads nothing for DAEMON_CLIENT_TIMEOUT_S is dropped so the next one
+ * gets its turn, and a touchpad that does not come back after an update
+ * is looked for again on the next request.
+ */
+#define DAEMON_CLIENT_TIMEOUT_S		10
+
+static int daemon_device_open;
+
+static int elan_daemon_reopen(struct query_cache *cache)
+{
+	cache->known = 0;
+	if (dev_fd >= 0)
+		close(dev_fd);
+	dev_fd = -1;
+	interface_type = -1;
+	identity_cached = 0;
+	daemon_device_open = !elan_open_tp();
+	return daemon_device_open ? 0 : -1;
+}
+
+static void elan_daemon_update(int state, char *image, struct query_cache *cache)
+{
+	int status;
+	pid_t child;
+
+	fflush(stdout);
+	elan_trace_flush();
+	child = fork();
+	if (child < 0) {
+		printf("err cannot fork (%s)\n", strerror(errno));
+		return;
+	}
+	if (child == 0) {
+		dup2(STDOUT_FILENO, STDERR_FILENO);
+		firmware_binary = image;
+		exit(elan_run_update(state) ? 1 : 0);
+	}
+	while ((waitpid(child, &status, 0) < 0) && (errno == EINTR))
+		;
+
+	/* The part was reset, open it again the way a new run would */
+	if (elan_daemon_reopen(cache) < 0)
+		printf("Daemon: touchpad not found after the update\n");
+
+	if (WIFEXITED(status) && !WEXITSTATUS(status))
+		printf("ok\n");
+	else
+		printf("err %d\n", WIFEXITED(status) ? WEXITSTATUS(status) : -WTERMSIG(status));
+}
+
+/* Handle one request line, the response goes to stdout.  Returns 1 on quit. */
+static int elan_daemon_request(char *line, struct query_cache *cache)
+{
+	char *cmd = strtok(line, " \t\r\n");
+	char *arg = strtok(NULL, " \t\r\n");
+	char reply[QUERY_JSON_SIZE + 3];
+	int mask = 0, i;
+
+	if (!cmd)
+		return 0;
+	if (strcmp(cmd, "quit") && !daemon_device_open &&
+	    (elan_daemon_reopen(cache) < 0)) {
+		printf("err touchpad not found\n");
+		return 0;
+	}
+	if (!strcmp(cmd, "query")) {
+		for (; arg; arg = strtok(NULL, " \t\r\n")) {
+			for (i = 0; i < QUERY_FIELDS; i++)
+				if (!strcmp(arg, query_fields[i].key))
+					break;
+			if (i == QUERY_FIELDS) {
+				printf("err unknown key %s\n", arg);
+				return 0;
+			}
+			mask |= 1 << i;
+		}
+		/* The whole line is built first, helper messages cannot split it */
+		strcpy(reply, "ok ");
+		elan_query_json(mask ? mask : QUERY_ALL, cache, reply + 3,
+				sizeof(reply) - 3);
+		fputs(reply, stdout);
+	} else if (!strcmp(cmd, "update") || !strcmp(cmd, "eeprom-update")) {
+		if (!arg)
+			printf("err missing image\n");
+		else
+			elan_daemon_update(strcmp(cmd, "update") ? EEPROM_IAP_STATE : IAP_STATE,
+					   arg, cache);
+	} else if (!strcmp(cmd, "quit")) {
+		printf("ok\n");
+		return 1;
+	} else {
+		printf("err unknown command %s\n", cmd);
+	}
+	return 0;
+}
+
+static int elan_daemon(const char *path)
+{
+	struct query_cache cache = { 0 };
+	struct timeval timeout = { .tv_sec = DAEMON_CLIENT_TIMEOUT_S };
+	struct sockaddr_un addr;
+	char line[PATH_MAX + 32];
+	int sock, client, out, quit = 0;
+	FILE *in;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		request_exit("Socket path %s is too long\n", path);
+	/* A client that goes away must not kill an update half way */
+	signal(SIGPIPE, SIG_IGN);
+	init_elan_tp();
+	daemon_device_open = 1;
+
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0)
+		request_exit("Daemon: socket failed (%s)\n", strerror(errno));
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	unlink(path);
+	if ((bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) ||
+	    (listen(sock, 8) < 0))
+		request_exit("Daemon: cannot listen on %s (%s)\n", path, strerror(errno));
+	printf("Daemon: %s interface, listening on %s\n", transport->name, path);
+	fflush(stdout);
+
+	while (!quit) {
+		client = accept(sock, NULL, NULL);
+		if (client < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+		in = fdopen(client, "r");
+		while (!quit && in && fgets(line, sizeof(line), in)) {
+			out = dup(STDOUT_FILENO);
+			dup2(client, STDOUT_FILENO);
+			quit = elan_daemon_request(line, &cache);
+			fflush(stdout);
+			dup2(out, STDOUT_FILENO);
+			close(out);
+		}
+		if (in)
+			fclose(in);
+		else
+			close(client);
+	}
+	close(sock);
+	unlink(path);
+	if (dev_fd >= 0)
+		close(dev_fd);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int state=parse_cmdline(argc, argv);
+
+	if (state==INSPECT_STATE)
+		return elan_inspect(inspect_path);
+	if (state==PACK_BUNDLE_STATE)
+		return elan_pack_bundle(pack_bundle_path, pack_bundle_dir);
+	if (state==SELFTEST_STATE)
+		return elan_checksum_selftest();
+	if (trace_path)
+		elan_trace_open(trace_path);
+	if (replay_path)
+		elan_replay_open(replay_path);
+	if (state==BENCH_STATE)
+		return elan_bench();
+	if (sim_enabled)
+		sim_setup();
+	if (state==SIM_DUMP_STATE)
+		return sim_dump_image(firmware_binary) ? 1 : 0;
+	if (state==QUERY_STATE)
+		return elan_query_batch(query_mask);
+	if (state==DAEMON_STATE)
+		return elan_daemon(daemon_path);
+
+	if(state==GET_FWVER_STATE)
+	{		
+		get_current_version();
+		return 0;
+	}
+	else if(state==GET_MODULEID_STATE)
+	{		
+		get_module_id();
+		return 0;
+	}
+	else if(state==GET_HWID_STATE)
+	{		
+		get_hardware_id();
+		return 0;
+	}	
+	else if(state==GET_SWVER_STATE)
+	{
+		printf("Version: %s.%s\n", VERSION, VERSION_SUB);
+		return 0;
+	}
+	else if(state==GET_FW_CHECKSUM_STATE)
+	{
+		get_fw_checksum();
+		return 0;
+	}
+	else if(state==GET_IAP_CHECKSUM_STATE)
+	{
+		get_iap_checksum();
+		return 0;
+	}
+	else if(state==GET_EEPROM_CHECKSUM_STATE)
+	{
+		get_eeprom_checksum();
+		return 0;
+	}
+	else if(state==GET_EEPROM_VERSION_STATE)
+	{
+		get_eeprom_version();
+		return 0;
+	}
+	else if(state==SET_REGION_LAYOUT_STATE)
+	{
+		set_region_code();
+		return 0;
+	}
+	else if(state==GET_REGION_LAYOUT_STATE)
+	{
+		get_region_code();
+		return 0;
+	}
+
+	return elan_run_update(state);
+}